@@ -1,38 +1,34 @@
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | 
       CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST; 
 
+/* Hardware filtered sampler, reading between two texels returns their
+   weighted average so one fetch covers two taps */
+__constant sampler_t linear_sampler = CLK_NORMALIZED_COORDS_FALSE | 
+      CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_LINEAR; 
 
-// 3x3 Blurring filter
-__constant float BlurringFilter[9] = {	0.077847, 0.123317, 0.077847,
-0.123317, 0.195346, 0.123317,
-0.077847, 0.123317, 0.077847};
+/* Building with -D RADIUS=n fixes the filter width at compile time so the
+   tap loops can be fully unrolled, otherwise the dim argument is used */
+#ifdef RADIUS
+#define FILTER_DIM (2*RADIUS + 1)
+#define LINEAR_TAPS (RADIUS + 1)
+#else
+#define FILTER_DIM dim
+#define LINEAR_TAPS taps
+#endif
 
+/* Output pixels produced by each work-item of the blocked kernels, the host
+   passes its own value with -D PIXELS_PER_ITEM so both sides agree */
+#ifndef PIXELS_PER_ITEM
+#define PIXELS_PER_ITEM 4
+#endif
 
-// 4x4 Blurring filter
-__constant float BlurringFilter2[25] = {	0.003765, 0.015019, 0.023792, 0.015019, 0.003765,
-0.015019, 0.059912, 0.094907, 0.059912, 0.015019,
-0.023792, 0.094907, 0.150342, 0.094907, 0.023792,
-0.015019, 0.059912, 0.094907, 0.059912, 0.015019,
-0.003765, 0.015019, 0.023792, 0.015019, 0.003765};
-
-
-__constant float BlurringFilter3[49] = { 0.000036, 0.000363, 0.001446, 0.002291, 0.001446, 0.000363, 0.000036,
-0.000363, 0.003676, 0.014662, 0.023226, 0.014662, 0.003676, 0.000363,
-0.001446, 0.014662, 0.058488, 0.092651, 0.058488, 0.014662, 0.001446,
-0.002291, 0.023226, 0.092651, 0.146768, 0.092651, 0.023226, 0.002291,
-0.001446, 0.014662, 0.058488, 0.092651, 0.058488, 0.014662, 0.001446,
-0.000363, 0.003676, 0.014662, 0.023226, 0.014662, 0.003676, 0.000363,
-0.000036, 0.000363, 0.001446, 0.002291, 0.001446, 0.000363, 0.000036 };
-
-
-
-__constant float SmartFilter1[3] = {0.27901, 0.44198, 0.27901};
-__constant float SmartFilter2[5] = {0.06136, 0.24477, 0.38774, 0.24477, 0.06136};
-__constant float SmartFilter3[7] = {0.00598, 0.060626, 0.241843, 0.383103, 0.241843, 0.060626, 0.00598};
-
+/* Filter weights are generated on the host for any radius and sigma and
+   passed in as a __constant buffer: dim*dim values for naive_blur and dim
+   values for the separable passes */
 
 __kernel void naive_blur(read_only image2d_t src_image,
-					write_only image2d_t dst_image, int dim) {
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
 
 
    /* Get work-item’s row and column position */
@@ -49,26 +45,23 @@ __kernel void naive_blur(read_only image2d_t src_image,
    float4 pixel;
 
 
-   int start = 0 - (int)floor(dim/2.0f);
-   int end = 0 + (int)floor(dim/2.0f);
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
 
    /* Iterate over the rows */
+   #pragma unroll
    for(int i = start; i <= end; i++) {
 	  coord.y =  row + i;
 
       /* Iterate over the columns */
+	  #pragma unroll
 	  for(int j = start; j <= end; j++) {
          coord.x = column + j;
 
 		 /* Read value pixel from the image */ 		
 		 pixel = read_imagef(src_image, sampler, coord);
 		 /* Acculumate weighted sum */
-		 if(dim == 3)
-			sum.xyz += pixel.xyz * BlurringFilter[filter_index++];
-		if(dim == 5)
-			sum.xyz += pixel.xyz * BlurringFilter2[filter_index++];
-		if(dim == 7)
-			sum.xyz += pixel.xyz * BlurringFilter3[filter_index++];
+		 sum.xyz += pixel.xyz * filter[filter_index++];
 	  }
    }
 
@@ -79,7 +72,8 @@ __kernel void naive_blur(read_only image2d_t src_image,
 
 
 __kernel void smart_blur_verticle(read_only image2d_t src_image,
-					write_only image2d_t dst_image, int dim) {
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
 
 
    /* Get work-item’s row and column position */
@@ -96,10 +90,11 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
    float4 pixel;
 
 
-   int start = 0 - (int)floor(dim/2.0f);
-   int end = 0 + (int)floor(dim/2.0f);
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
 
       /* Iterate over the rows */
+   #pragma unroll
    for(int i = start; i <= end; i++) {
 	  coord.y =  row + i;
 	  coord.x = column;
@@ -107,12 +102,7 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
 	  	/* Read value pixel from the image */ 		
 		 pixel = read_imagef(src_image, sampler, coord);
 		 /* Acculumate weighted sum */
-		 if(dim == 3)
-			sum.xyz += pixel.xyz * SmartFilter1[filter_index++];
-		if(dim == 5)
-			sum.xyz += pixel.xyz * SmartFilter2[filter_index++];
-		if(dim == 7)
-			sum.xyz += pixel.xyz * SmartFilter3[filter_index++];
+		 sum.xyz += pixel.xyz * filter[filter_index++];
 
    }
 
@@ -121,7 +111,8 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
 }
 
 __kernel void smart_blur_horizontal(read_only image2d_t src_image,
-					write_only image2d_t dst_image, int dim) {
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
 
 
    /* Get work-item’s row and column position */
@@ -138,10 +129,11 @@ __kernel void smart_blur_horizontal(read_only image2d_t src_image,
    float4 pixel;
 
 
-   int start = 0 - (int)floor(dim/2.0f);
-   int end = 0 + (int)floor(dim/2.0f);
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
 
       /* Iterate over the rows */
+   #pragma unroll
    for(int i = start; i <= end; i++) {
 	  coord.y =  row;
 	  coord.x = column + i;
@@ -149,15 +141,897 @@ __kernel void smart_blur_horizontal(read_only image2d_t src_image,
 	  	/* Read value pixel from the image */ 		
 		 pixel = read_imagef(src_image, sampler, coord);
 		 /* Acculumate weighted sum */
-		 if(dim == 3)
-			sum.xyz += pixel.xyz * SmartFilter1[filter_index++];
-		if(dim == 5)
-			sum.xyz += pixel.xyz * SmartFilter2[filter_index++];
-		if(dim == 7)
-			sum.xyz += pixel.xyz * SmartFilter3[filter_index++];
+		 sum.xyz += pixel.xyz * filter[filter_index++];
 
    }
 
 	  coord = (int2)(column, row); 
 	  write_imagef(dst_image, coord, sum);
-}
\ No newline at end of file
+}
+
+/*
+ * Tiled variants of the separable passes. Each work-group loads its tile
+ * plus a radius wide halo into local memory once, then every tap is read
+ * from the tile instead of the image. The global size may be rounded up
+ * to a multiple of the local size, so writes outside the image are skipped.
+ */
+__kernel void smart_blur_verticle_tiled(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter, __local float4* tile) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   int lx = get_local_id(0);
+   int ly = get_local_id(1);
+   int lw = get_local_size(0);
+   int lh = get_local_size(1);
+
+   int radius = FILTER_DIM/2;
+   int tile_h = lh + 2*radius;
+
+   /* Image row held in the first row of the tile */
+   int top = get_group_id(1)*lh - radius;
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Load the tile and halo, the sampler clamps rows outside the image */
+   for(int i = ly; i < tile_h; i += lh) {
+      tile[i*lw + lx] = read_imagef(src_image, sampler, (int2)(column, top + i));
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Iterate over the rows */
+   #pragma unroll
+   for(int i = 0; i < FILTER_DIM; i++) {
+      sum.xyz += tile[(ly + i)*lw + lx].xyz * filter[i];
+   }
+
+   if(column < get_image_width(dst_image) && row < get_image_height(dst_image))
+      write_imagef(dst_image, (int2)(column, row), sum);
+}
+
+__kernel void smart_blur_horizontal_tiled(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter, __local float4* tile) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   int lx = get_local_id(0);
+   int ly = get_local_id(1);
+   int lw = get_local_size(0);
+
+   int radius = FILTER_DIM/2;
+   int tile_w = lw + 2*radius;
+
+   /* Image column held in the first column of the tile */
+   int left = get_group_id(0)*lw - radius;
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Load the tile and halo, the sampler clamps columns outside the image */
+   for(int i = lx; i < tile_w; i += lw) {
+      tile[ly*tile_w + i] = read_imagef(src_image, sampler, (int2)(left + i, row));
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   /* Iterate over the columns */
+   #pragma unroll
+   for(int i = 0; i < FILTER_DIM; i++) {
+      sum.xyz += tile[ly*tile_w + lx + i].xyz * filter[i];
+   }
+
+   if(column < get_image_width(dst_image) && row < get_image_height(dst_image))
+      write_imagef(dst_image, (int2)(column, row), sum);
+}
+
+/*
+ * Separable passes using the linear sampler. Each entry of filter holds the
+ * offset from the centre pixel in .x and the merged weight of two adjacent
+ * taps in .y, so a dim wide filter needs only taps = radius + 1 fetches.
+ * Coordinates are shifted by half a pixel to address texel centres.
+ */
+__kernel void smart_blur_verticle_linear(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int taps,
+					__constant float2* filter) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   float2 coord;
+   float4 pixel;
+
+   coord.x = column + 0.5f;
+
+      /* Iterate over the merged taps */
+   #pragma unroll
+   for(int i = 0; i < LINEAR_TAPS; i++) {
+	  coord.y = row + 0.5f + filter[i].x;
+
+		 pixel = read_imagef(src_image, linear_sampler, coord);
+		 sum.xyz += pixel.xyz * filter[i].y;
+   }
+
+	  write_imagef(dst_image, (int2)(column, row), sum);
+}
+
+__kernel void smart_blur_horizontal_linear(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int taps,
+					__constant float2* filter) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   float2 coord;
+   float4 pixel;
+
+   coord.y = row + 0.5f;
+
+      /* Iterate over the merged taps */
+   #pragma unroll
+   for(int i = 0; i < LINEAR_TAPS; i++) {
+	  coord.x = column + 0.5f + filter[i].x;
+
+		 pixel = read_imagef(src_image, linear_sampler, coord);
+		 sum.xyz += pixel.xyz * filter[i].y;
+   }
+
+	  write_imagef(dst_image, (int2)(column, row), sum);
+}
+
+/*
+ * Register blocked variants. Each work-item produces PIXELS_PER_ITEM outputs
+ * along the filter direction. Every source pixel in the run plus its halo is
+ * read once and added into each output whose window covers it, so a run
+ * costs dim + PIXELS_PER_ITEM - 1 fetches instead of dim * PIXELS_PER_ITEM.
+ */
+__kernel void naive_blur_blocked(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
+
+
+   /* First column of this work-item's run and its row */
+   int column = get_global_id(0) * PIXELS_PER_ITEM;
+   int row = get_global_id(1);
+
+   int width = get_image_width(dst_image);
+   int radius = FILTER_DIM/2;
+
+   /* Accumulated pixel values for the run */
+   float4 sum[PIXELS_PER_ITEM];
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++)
+      sum[j] = (float4)(0.0);
+
+   int2 coord;
+   float4 pixel;
+
+   /* Iterate over the rows */
+   #pragma unroll
+   for(int i = 0; i < FILTER_DIM; i++) {
+	  coord.y = row + i - radius;
+
+      /* Slide across the run and its halo */
+	  for(int k = 0; k < FILTER_DIM + PIXELS_PER_ITEM - 1; k++) {
+         coord.x = column + k - radius;
+		 pixel = read_imagef(src_image, sampler, coord);
+
+		 #pragma unroll
+		 for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+			int tap = k - j;
+			if(tap >= 0 && tap < FILTER_DIM)
+			   sum[j].xyz += pixel.xyz * filter[i*FILTER_DIM + tap];
+		 }
+	  }
+   }
+
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+      if(column + j < width)
+         write_imagef(dst_image, (int2)(column + j, row), sum[j]);
+   }
+}
+
+__kernel void smart_blur_verticle_blocked(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
+
+
+   /* Column of this work-item and the first row of its run */
+   int column = get_global_id(0); 
+   int row = get_global_id(1) * PIXELS_PER_ITEM;
+
+   int height = get_image_height(dst_image);
+   int radius = FILTER_DIM/2;
+
+   /* Accumulated pixel values for the run */
+   float4 sum[PIXELS_PER_ITEM];
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++)
+      sum[j] = (float4)(0.0);
+
+   float4 pixel;
+
+   /* Slide down the run and its halo */
+   for(int k = 0; k < FILTER_DIM + PIXELS_PER_ITEM - 1; k++) {
+	  pixel = read_imagef(src_image, sampler, (int2)(column, row + k - radius));
+
+	  #pragma unroll
+	  for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+		 int tap = k - j;
+		 if(tap >= 0 && tap < FILTER_DIM)
+			sum[j].xyz += pixel.xyz * filter[tap];
+	  }
+   }
+
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+      if(row + j < height)
+         write_imagef(dst_image, (int2)(column, row + j), sum[j]);
+   }
+}
+
+__kernel void smart_blur_horizontal_blocked(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
+
+
+   /* First column of this work-item's run and its row */
+   int column = get_global_id(0) * PIXELS_PER_ITEM;
+   int row = get_global_id(1);
+
+   int width = get_image_width(dst_image);
+   int radius = FILTER_DIM/2;
+
+   /* Accumulated pixel values for the run */
+   float4 sum[PIXELS_PER_ITEM];
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++)
+      sum[j] = (float4)(0.0);
+
+   float4 pixel;
+
+   /* Slide across the run and its halo */
+   for(int k = 0; k < FILTER_DIM + PIXELS_PER_ITEM - 1; k++) {
+	  pixel = read_imagef(src_image, sampler, (int2)(column + k - radius, row));
+
+	  #pragma unroll
+	  for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+		 int tap = k - j;
+		 if(tap >= 0 && tap < FILTER_DIM)
+			sum[j].xyz += pixel.xyz * filter[tap];
+	  }
+   }
+
+   #pragma unroll
+   for(int j = 0; j < PIXELS_PER_ITEM; j++) {
+      if(column + j < width)
+         write_imagef(dst_image, (int2)(column + j, row), sum[j]);
+   }
+}
+
+/*
+ * Recursive Gaussian (Young and van Vliet). Each work-item filters a whole
+ * column or row with a third order causal pass followed by an anti-causal
+ * pass, so the cost per pixel does not depend on sigma. coeff holds b1/b0,
+ * b2/b0 and b3/b0 in .xyz and the gain B in .w. The causal results are kept
+ * in scratch, laid out so neighbouring work-items touch neighbouring
+ * addresses. Both passes start in the steady state of the edge pixel, which
+ * matches the clamp to edge used by the other kernels.
+ */
+__kernel void iir_blur_verticle(read_only image2d_t src_image,
+					write_only image2d_t dst_image, __global float4* scratch,
+					float4 coeff) {
+
+   int column = get_global_id(0);
+   int width = get_image_width(src_image);
+   int height = get_image_height(src_image);
+
+   if(column >= width)
+      return;
+
+   float4 x = read_imagef(src_image, sampler, (int2)(column, 0));
+   float4 w1 = x, w2 = x, w3 = x, wn;
+
+   /* Causal pass down the column */
+   for(int i = 0; i < height; i++) {
+      x = read_imagef(src_image, sampler, (int2)(column, i));
+      wn = coeff.w*x + coeff.x*w1 + coeff.y*w2 + coeff.z*w3;
+      scratch[i*width + column] = wn;
+      w3 = w2; w2 = w1; w1 = wn;
+   }
+
+   float4 y1 = w1, y2 = w1, y3 = w1, yn;
+
+   /* Anti-causal pass back up */
+   for(int i = height - 1; i >= 0; i--) {
+      yn = coeff.w*scratch[i*width + column] + coeff.x*y1 + coeff.y*y2 + coeff.z*y3;
+      write_imagef(dst_image, (int2)(column, i), yn);
+      y3 = y2; y2 = y1; y1 = yn;
+   }
+}
+
+__kernel void iir_blur_horizontal(read_only image2d_t src_image,
+					write_only image2d_t dst_image, __global float4* scratch,
+					float4 coeff) {
+
+   int row = get_global_id(0);
+   int width = get_image_width(src_image);
+   int height = get_image_height(src_image);
+
+   if(row >= height)
+      return;
+
+   float4 x = read_imagef(src_image, sampler, (int2)(0, row));
+   float4 w1 = x, w2 = x, w3 = x, wn;
+
+   /* Causal pass along the row, stored transposed */
+   for(int i = 0; i < width; i++) {
+      x = read_imagef(src_image, sampler, (int2)(i, row));
+      wn = coeff.w*x + coeff.x*w1 + coeff.y*w2 + coeff.z*w3;
+      scratch[i*height + row] = wn;
+      w3 = w2; w2 = w1; w1 = wn;
+   }
+
+   float4 y1 = w1, y2 = w1, y3 = w1, yn;
+
+   /* Anti-causal pass back */
+   for(int i = width - 1; i >= 0; i--) {
+      yn = coeff.w*scratch[i*height + row] + coeff.x*y1 + coeff.y*y2 + coeff.z*y3;
+      write_imagef(dst_image, (int2)(i, row), yn);
+      y3 = y2; y2 = y1; y1 = yn;
+   }
+}
+
+/*
+ * Summed-area table (integral image). Each entry holds the RGBA sums, in
+ * 0-255 units, of every pixel above and to the left of it inclusive. 32-bit
+ * sums may wrap on large frames, but any rectangle whose own sum fits in 32
+ * bits is still exact because the lookups subtract modulo 2^32. Building
+ * with -D SAT_64 switches to 64-bit sums.
+ */
+#ifdef SAT_64
+typedef ulong4 sat_t;
+#define convert_sat_t convert_ulong4
+#else
+typedef uint4 sat_t;
+#define convert_sat_t convert_uint4
+#endif
+
+/* One work-group per row scans it a chunk at a time, carrying the running total */
+__kernel void sat_scan_rows(read_only image2d_t src_image,
+					__global sat_t* sat, __local sat_t* scratch) {
+
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+   int row = get_global_id(1);
+   int width = get_image_width(src_image);
+
+   sat_t carry = (sat_t)(0);
+
+   for(int start = 0; start < width; start += group_size) {
+      int column = start + lid;
+      float4 pixel = read_imagef(src_image, sampler, (int2)(column, row));
+
+      scratch[lid] = (column < width) ?
+         convert_sat_t(convert_uint4_sat_rte(pixel * 255.0f)) : (sat_t)(0);
+      barrier(CLK_LOCAL_MEM_FENCE);
+
+      /* Inclusive Hillis-Steele scan of the chunk */
+      for(int offset = 1; offset < group_size; offset <<= 1) {
+         sat_t add = (lid >= offset) ? scratch[lid - offset] : (sat_t)(0);
+         barrier(CLK_LOCAL_MEM_FENCE);
+         scratch[lid] += add;
+         barrier(CLK_LOCAL_MEM_FENCE);
+      }
+
+      if(column < width)
+         sat[row*width + column] = scratch[lid] + carry;
+      carry += scratch[group_size - 1];
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+}
+
+/* One work-item per column accumulates the row sums downwards, neighbouring
+   work-items read neighbouring addresses */
+__kernel void sat_scan_columns(__global sat_t* sat, int width, int height) {
+
+   int column = get_global_id(0);
+
+   if(column >= width)
+      return;
+
+   sat_t sum = (sat_t)(0);
+   for(int row = 0; row < height; row++) {
+      sum += sat[row*width + column];
+      sat[row*width + column] = sum;
+   }
+}
+
+/* Sum over the inclusive rectangle (x0, y0) to (x1, y1) inside the image */
+sat_t sat_rect(__global const sat_t* sat, int width, int x0, int y0, int x1, int y1) {
+
+   sat_t sum = sat[y1*width + x1];
+
+   if(x0 > 0)
+      sum -= sat[y1*width + x0 - 1];
+   if(y0 > 0)
+      sum -= sat[(y0 - 1)*width + x1];
+   if(x0 > 0 && y0 > 0)
+      sum += sat[(y0 - 1)*width + x0 - 1];
+
+   return sum;
+}
+
+/* Box blur of any radius in four lookups, averaging only pixels inside the image */
+__kernel void sat_box_blur(__global const sat_t* sat,
+					write_only image2d_t dst_image, int radius) {
+
+   int column = get_global_id(0);
+   int row = get_global_id(1);
+   int width = get_image_width(dst_image);
+   int height = get_image_height(dst_image);
+
+   int x0 = max(column - radius, 0);
+   int y0 = max(row - radius, 0);
+   int x1 = min(column + radius, width - 1);
+   int y1 = min(row + radius, height - 1);
+
+   float area = (x1 - x0 + 1)*(y1 - y0 + 1);
+   float4 sum = convert_float4(sat_rect(sat, width, x0, y0, x1, y1));
+
+   write_imagef(dst_image, (int2)(column, row), sum / (area * 255.0f));
+}
+
+/* Luminance sum, in 0-255 units, of each inclusive (x0, y0, x1, y1) region */
+__kernel void sat_region_luminance(__global const sat_t* sat, int width,
+					__global const int4* regions, __global float* sums) {
+
+   int i = get_global_id(0);
+   int4 r = regions[i];
+
+   float4 sum = convert_float4(sat_rect(sat, width, r.x, r.y, r.z, r.w));
+
+   /* CL_R frames read back as (r, 0, 0, 1), the red channel is the luminance */
+#ifdef GREYSCALE
+   sums[i] = sum.s0;
+#else
+   sums[i] = (sum.s0 * 0.299f) + (sum.s1 * 0.587f) + (sum.s2 * 0.114f);
+#endif
+}
+
+/*
+ * Frequency domain convolution. The frame is padded to power of two sizes
+ * and each float4 element holds two complex values, (R + iG) and (B + iA),
+ * so one transform covers all four channels. Because the filter is real,
+ * multiplying both pairs by its spectrum convolves each channel separately.
+ */
+
+/* Multiply both complex pairs in a by the complex value w */
+float4 complex_mul2(float4 a, float2 w) {
+   return (float4)(a.x*w.x - a.y*w.y, a.x*w.y + a.y*w.x,
+                   a.z*w.x - a.w*w.y, a.z*w.y + a.w*w.x);
+}
+
+/* Copy the frame into the padded buffer shifted by radius, clamping at the edges */
+__kernel void fft_load(read_only image2d_t src_image,
+					__global float4* data, int padded_width, int radius) {
+
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+
+   data[y*padded_width + x] = read_imagef(src_image, sampler, (int2)(x - radius, y - radius));
+}
+
+/*
+ * One radix-2 Stockham pass over n points spaced stride apart, starting at
+ * base. Work-item i combines inputs i and i + n/2 and writes them back in
+ * order, so no bit reversal pass is needed. sign is -1 forward and 1 inverse.
+ */
+void fft_butterfly(__global const float4* src, __global float4* dst,
+					int base, int stride, int n, int p, int i, float sign) {
+
+   int k = i & (p - 1);
+   int j = (i << 1) - k;
+
+   float4 u0 = src[base + i*stride];
+   float4 u1 = src[base + (i + n/2)*stride];
+
+   float angle = sign * M_PI_F * k / p;
+   u1 = complex_mul2(u1, (float2)(cos(angle), sin(angle)));
+
+   dst[base + j*stride] = u0 + u1;
+   dst[base + (j + p)*stride] = u0 - u1;
+}
+
+/* Pass p along every row, work-items of a row are neighbours */
+__kernel void fft_pass_rows(__global const float4* src, __global float4* dst,
+					int n, int p, float sign) {
+
+   int i = get_global_id(0);
+   int row = get_global_id(1);
+
+   fft_butterfly(src, dst, row*n, 1, n, p, i, sign);
+}
+
+/* Pass p down every column, neighbouring work-items take neighbouring columns */
+__kernel void fft_pass_columns(__global const float4* src, __global float4* dst,
+					int n, int p, int padded_width, float sign) {
+
+   int column = get_global_id(0);
+   int i = get_global_id(1);
+
+   fft_butterfly(src, dst, column, padded_width, n, p, i, sign);
+}
+
+/* Multiply by the filter spectrum held in .xy, scale folds in the inverse's 1/N */
+__kernel void fft_multiply(__global float4* data,
+					__global const float4* spectrum, float scale) {
+
+   int i = get_global_id(0);
+
+   data[i] = complex_mul2(data[i], spectrum[i].xy) * scale;
+}
+
+/* Copy the convolved frame out of the padded buffer */
+__kernel void fft_store(__global const float4* data,
+					write_only image2d_t dst_image, int padded_width, int radius) {
+
+   int x = get_global_id(0);
+   int y = get_global_id(1);
+
+   write_imagef(dst_image, (int2)(x, y), data[(y + radius)*padded_width + x + radius]);
+}
+
+/*
+ * General convolution. The column pass reuses smart_blur_verticle writing
+ * into a float image so negative weights are not clamped between passes.
+ * When a filter is a sum of several separable terms, each row pass adds its
+ * term into a float accumulator that is then written to the output image.
+ */
+__kernel void conv_rows_accumulate(read_only image2d_t src_image,
+					__global float4* accumulator, int dim,
+					__constant float* filter, int accumulate) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+   int width = get_image_width(src_image);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   int2 coord;
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+
+      /* Iterate over the columns */
+   for(int i = 0; i < FILTER_DIM; i++) {
+	  coord.y =  row;
+	  coord.x = column + start + i;
+
+		 pixel = read_imagef(src_image, sampler, coord);
+		 sum.xyz += pixel.xyz * filter[i];
+   }
+
+   if(accumulate)
+      sum += accumulator[row*width + column];
+   accumulator[row*width + column] = sum;
+}
+
+__kernel void accumulator_to_image(__global const float4* accumulator,
+					write_only image2d_t dst_image) {
+
+   int2 coord = (int2)(get_global_id(0), get_global_id(1));
+   int width = get_image_width(dst_image);
+
+   write_imagef(dst_image, coord, accumulator[coord.y*width + coord.x]);
+}
+
+/*
+ * Buffer backend. The naive and two pass blurs on __global uchar4 frames of
+ * width x height, for devices that emulate image objects. Edges are clamped
+ * explicitly and results are rounded back to 8 bits the way a CL_UNORM_INT8
+ * image write does, so both backends give the same output.
+ */
+float4 read_clamped(__global const uchar4* src, int x, int y, int width, int height) {
+   x = clamp(x, 0, width - 1);
+   y = clamp(y, 0, height - 1);
+   return convert_float4(src[y*width + x]) / 255.0f;
+}
+
+void write_unorm(__global uchar4* dst, int x, int y, int width, float4 pixel) {
+   dst[y*width + x] = convert_uchar4_sat_rte(pixel * 255.0f);
+}
+
+__kernel void naive_blur_buffer(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant float* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   /* Iterate over the rows */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+
+      /* Iterate over the columns */
+	  #pragma unroll
+	  for(int j = start; j <= end; j++) {
+		 pixel = read_clamped(src, column + j, row + i, width, height);
+		 sum.xyz += pixel.xyz * filter[filter_index++];
+	  }
+   }
+
+   write_unorm(dst, column, row, width, sum);
+}
+
+__kernel void smart_blur_verticle_buffer(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant float* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the rows */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+		 pixel = read_clamped(src, column, row + i, width, height);
+		 sum.xyz += pixel.xyz * filter[filter_index++];
+   }
+
+   write_unorm(dst, column, row, width, sum);
+}
+
+__kernel void smart_blur_horizontal_buffer(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant float* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the columns */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+		 pixel = read_clamped(src, column + i, row, width, height);
+		 sum.xyz += pixel.xyz * filter[filter_index++];
+   }
+
+   write_unorm(dst, column, row, width, sum);
+}
+
+/*
+ * Fixed-point variants of the buffer backend. Weights are 16-bit with
+ * FIXED_SHIFT fractional bits summing to 1 << FIXED_SHIFT, so a weighted
+ * sum of 8-bit channels fits in 32 bits and rounding to nearest on the
+ * final shift keeps the result within one step of the float kernels.
+ */
+#ifndef FIXED_SHIFT
+#define FIXED_SHIFT 15
+#endif
+
+uint4 fetch_clamped(__global const uchar4* src, int x, int y, int width, int height) {
+   x = clamp(x, 0, width - 1);
+   y = clamp(y, 0, height - 1);
+   return convert_uint4(src[y*width + x]);
+}
+
+void write_fixed(__global uchar4* dst, int x, int y, int width, uint4 sum) {
+   sum = (sum + (1u << (FIXED_SHIFT - 1))) >> FIXED_SHIFT;
+   dst[y*width + x] = convert_uchar4_sat(sum);
+}
+
+__kernel void naive_blur_fixed(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant ushort* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value, alpha stays 0 like the float kernels */
+   uint4 sum = (uint4)(0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   /* Iterate over the rows */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+
+      /* Iterate over the columns */
+	  #pragma unroll
+	  for(int j = start; j <= end; j++) {
+		 sum.xyz += fetch_clamped(src, column + j, row + i, width, height).xyz * filter[filter_index++];
+	  }
+   }
+
+   write_fixed(dst, column, row, width, sum);
+}
+
+__kernel void smart_blur_verticle_fixed(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant ushort* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   uint4 sum = (uint4)(0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the rows */
+   #pragma unroll
+   for(int i = start; i <= end; i++)
+		 sum.xyz += fetch_clamped(src, column, row + i, width, height).xyz * filter[filter_index++];
+
+   write_fixed(dst, column, row, width, sum);
+}
+
+__kernel void smart_blur_horizontal_fixed(__global const uchar4* src,
+					__global uchar4* dst, int dim,
+					__constant ushort* filter, int width, int height) {
+
+
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   /* Accumulated pixel value */
+   uint4 sum = (uint4)(0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the columns */
+   #pragma unroll
+   for(int i = start; i <= end; i++)
+		 sum.xyz += fetch_clamped(src, column + i, row, width, height).xyz * filter[filter_index++];
+
+   write_fixed(dst, column, row, width, sum);
+}
+
+/*
+ * Batched separable passes. Every layer of the image arrays is a separate
+ * frame of the same size and the third global dimension selects the layer,
+ * so a whole batch is blurred in one launch per pass.
+ */
+__kernel void smart_blur_verticle_array(read_only image2d_array_t src_image,
+					write_only image2d_array_t dst_image, int dim,
+					__constant float* filter) {
+
+
+   /* Get work-item’s row, column and layer */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+   int layer = get_global_id(2);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   int4 coord = (int4)(column, 0, layer, 0);
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the rows */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+	  coord.y =  row + i;
+		 pixel = read_imagef(src_image, sampler, coord);
+		 sum.xyz += pixel.xyz * filter[filter_index++];
+   }
+
+	  coord.y = row;
+	  write_imagef(dst_image, coord, sum);
+}
+
+__kernel void smart_blur_horizontal_array(read_only image2d_array_t src_image,
+					write_only image2d_array_t dst_image, int dim,
+					__constant float* filter) {
+
+
+   /* Get work-item’s row, column and layer */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+   int layer = get_global_id(2);
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Filter's current index */
+   int filter_index =  0;
+
+   int4 coord = (int4)(0, row, layer, 0);
+   float4 pixel;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+      /* Iterate over the columns */
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+	  coord.x = column + i;
+		 pixel = read_imagef(src_image, sampler, coord);
+		 sum.xyz += pixel.xyz * filter[filter_index++];
+   }
+
+	  coord.x = column;
+	  write_imagef(dst_image, coord, sum);
+}
@@ -3,17 +3,162 @@
 #define KERNEL_FUNC_1 "naive_blur"
 #define KERNEL_FUNC_2a "smart_blur_verticle"
 #define KERNEL_FUNC_2b "smart_blur_horizontal"
+#define KERNEL_FUNC_3a "smart_blur_verticle_tiled"
+#define KERNEL_FUNC_3b "smart_blur_horizontal_tiled"
+#define KERNEL_FUNC_4a "smart_blur_verticle_linear"
+#define KERNEL_FUNC_4b "smart_blur_horizontal_linear"
+#define KERNEL_FUNC_5 "naive_blur_blocked"
+#define KERNEL_FUNC_5a "smart_blur_verticle_blocked"
+#define KERNEL_FUNC_5b "smart_blur_horizontal_blocked"
+#define KERNEL_FUNC_6a "iir_blur_verticle"
+#define KERNEL_FUNC_6b "iir_blur_horizontal"
+#define KERNEL_SAT_ROWS "sat_scan_rows"
+#define KERNEL_SAT_COLUMNS "sat_scan_columns"
+#define KERNEL_SAT_BOX "sat_box_blur"
+#define KERNEL_SAT_REGIONS "sat_region_luminance"
+#define KERNEL_FFT_LOAD "fft_load"
+#define KERNEL_FFT_ROWS "fft_pass_rows"
+#define KERNEL_FFT_COLUMNS "fft_pass_columns"
+#define KERNEL_FFT_MULTIPLY "fft_multiply"
+#define KERNEL_FFT_STORE "fft_store"
+#define KERNEL_CONV_ROWS "conv_rows_accumulate"
+#define KERNEL_CONV_STORE "accumulator_to_image"
+#define KERNEL_BUF_NAIVE "naive_blur_buffer"
+#define KERNEL_BUF_VERTICAL "smart_blur_verticle_buffer"
+#define KERNEL_BUF_HORIZONTAL "smart_blur_horizontal_buffer"
+#define KERNEL_FIXED_NAIVE "naive_blur_fixed"
+#define KERNEL_FIXED_VERTICAL "smart_blur_verticle_fixed"
+#define KERNEL_FIXED_HORIZONTAL "smart_blur_horizontal_fixed"
+#define KERNEL_ARRAY_VERTICAL "smart_blur_verticle_array"
+#define KERNEL_ARRAY_HORIZONTAL "smart_blur_horizontal_array"
 
 #define INPUT_FILE "bunnycity2.bmp"
+#define GREY_INPUT_FILE "bunnycity2_grey.bmp"
 #define OUTPUT_FILE_1 "output_naive.bmp"
 #define OUTPUT_FILE_2 "output_smart.bmp"
+#define OUTPUT_FILE_3 "output_tiled.bmp"
+#define OUTPUT_FILE_4 "output_linear.bmp"
+#define OUTPUT_FILE_5 "output_naive_blocked.bmp"
+#define OUTPUT_FILE_6 "output_blocked.bmp"
+#define OUTPUT_FILE_7 "output_recursive.bmp"
+#define OUTPUT_FILE_8 "output_box.bmp"
+#define OUTPUT_FILE_9 "output_fft.bmp"
+#define OUTPUT_FILE_10 "output_naive_buffer.bmp"
+#define OUTPUT_FILE_11 "output_smart_buffer.bmp"
+#define OUTPUT_FILE_12 "output_naive_fixed.bmp"
+#define OUTPUT_FILE_13 "output_smart_fixed.bmp"
+#define OUTPUT_FILE_AUTO "output_auto.bmp"
+#define OUTPUT_FILE_CONV "output_conv_%s.bmp"
 #define NUM_ROUNDS 1000
 
+/* Set to 1 to read GREY_INPUT_FILE as one byte per pixel and blur CL_R
+   images. The uchar4 buffer modes are skipped in this mode */
+#define GREYSCALE 0
+#define CHANNELS (GREYSCALE ? 1 : 4)
+
+/* Set to 0 to skip checking the linear sampler output against the two pass output */
+#define COMPARE_LINEAR 1
+
+/* Fractional bits of the fixed-point weights, they sum to 1 << FIXED_SHIFT
+   and must fit in 16 bits. Set COMPARE_FIXED to 0 to skip checking the
+   fixed-point output against the float output */
+#define FIXED_SHIFT 15
+#define COMPARE_FIXED 1
+
+/* Set to 0 to keep the vertical pass result in the frame format instead of
+   a CL_HALF_FLOAT image, devices without half images always do */
+#define HALF_INTERMEDIATES 1
+
+/* Work-group edge length for the tiled kernels */
+#define TILE_SIZE 16
+
+/* Kernels are specialized with -D RADIUS up to this radius, beyond it the
+   unrolled loops only bloat the binary and the generic kernels are used.
+   Set SPECIALIZE_RADIUS to 0 to always use the generic kernels */
+#define SPECIALIZE_RADIUS 1
+#define MAX_SPECIALIZED_RADIUS 8
+#define MAX_VARIANTS 64
+
+/* Output pixels per work-item in the blocked kernels, passed to every build */
+#define PIXELS_PER_ITEM 4
+
+/* Set to 1 for 64-bit summed-area table entries, needed only when a single
+   queried region can sum past 2^32 */
+#define SAT_64BIT 0
+
+/* Box passes stacked to approximate a Gaussian, and the row scan work-group size */
+#define BOX_PASSES 3
+#define SCAN_GROUP_SIZE 256
+
+/* Regions per side of the luminance metering grid printed after the benchmark */
+#define METERING_GRID 3
+
+/* Set to 0 to skip timing the FFT path against the two pass path over a
+   range of radii, CROSSOVER_ROUNDS runs are averaged at each radius */
+#define RUN_CROSSOVER 1
+#define CROSSOVER_ROUNDS 10
+#define CROSSOVER_MAX_RADIUS 128
+
+/* Set to 0 to skip running the example filters through convolve(). Filters
+   needing more separable terms than MAX_SEPARABLE_RANK run as a single 2D
+   pass, singular values below SEPARABLE_TOLERANCE of the largest are dropped */
+#define RUN_CONVOLUTIONS 1
+#define MAX_SEPARABLE_RANK 4
+#define SEPARABLE_TOLERANCE 1e-4
+
+/* Set to 0 to skip the automatic mode. Each mode is calibrated with
+   PROBE_ROUNDS timed runs at both probe radii after one warm-up run, and
+   again at the low radius on a PROBE_SIDE square crop to separate the
+   per-launch cost from the per-pixel cost */
+#define RUN_AUTO 1
+#define PROBE_ROUNDS 5
+#define PROBE_RADIUS_LOW 2
+#define PROBE_RADIUS_HIGH 8
+#define PROBE_SIDE 64
+#define MAX_DECISIONS 32
+
+/* Copies of the input blurred as one batch after the benchmark, 0 skips it.
+   Batches larger than the device's image array limit run in several launches */
+#define BATCH_FRAMES 16
+
+/* Frames that do not fit in 1/STRIP_MEMORY_FRACTION of the device memory,
+   or are wider than the image width limit, skip the benchmark and are
+   blurred in tiles of rows and columns with a radius halo.
+   Set STRIP_ROWS to also blur fitting frames in strips of that many rows
+   after the benchmark and compare them with the whole frame two pass blur */
+#define STRIP_ROWS 128
+#define STRIP_MEMORY_FRACTION 4
+#define OUTPUT_FILE_STRIPS "output_strips.bmp"
+
+/* Set to 1 to blur the frame once more split into bands across every
+   device with image support, each band sized to the device's throughput
+   on a probe band of BAND_PROBE_ROWS rows */
+#define RUN_MULTI_DEVICE 1
+#define MAX_DEVICES 8
+#define BAND_PROBE_ROWS 64
+#define OUTPUT_FILE_MULTI "output_multi_device.bmp"
+
+/* Set to 1 to split a CPU device into sub-devices and blur FISSION_JOBS
+   copies of the frame as independent jobs spread over them, against the
+   same jobs on the whole device. FISSION_UNITS compute units go to each
+   sub-device, 0 splits by NUMA affinity domain instead, or equally between
+   the jobs when there is only one domain */
+#define RUN_FISSION 1
+#define FISSION_UNITS 0
+#define FISSION_JOBS 32
+#define MAX_SUB_DEVICES 64
+
+/* Device bytes per pixel of a session, three frames, a half intermediate
+   and the four uchar4 buffers */
+#define BYTES_PER_PIXEL (5 * CHANNELS + 16)
+
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "bmpfuncs.h"
 #include <iostream>
+#include <chrono>
 
 #ifdef MAC
 #include <OpenCL/cl.h>
@@ -136,8 +281,9 @@ cl_device_id create_device() {
    return dev;
 }
 
-/* Create program from a file and compile it */
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+/* Create program from a file and compile it, options may be NULL */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
+   const char* options = NULL) {
 
    cl_program program;
    FILE *program_handle;
@@ -169,7 +315,7 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
    free(program_buffer);
 
    /* Build program */
-   err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+   err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
    if(err < 0) {
 
       /* Find size of log and print to std output */
@@ -203,236 +349,2937 @@ void print_device(cl_device_id device) {
 		name_data);
 }
 
-int main(int argc, char **argv) {
+/* Normalized 1D Gaussian weights for the taps -radius..radius */
+float* gaussian_weights(int radius, float sigma) {
+	int dim = 2 * radius + 1;
+	float* weights = (float*)malloc(sizeof(float) * dim);
+	double total = 0;
+
+	for (int i = 0; i < dim; i++) {
+		double x = i - radius;
+		weights[i] = (float)exp(-(x * x) / (2.0 * sigma * sigma));
+		total += weights[i];
+	}
+	for (int i = 0; i < dim; i++)
+		weights[i] = (float)(weights[i] / total);
+
+	return weights;
+}
+
+/* Normalized dim x dim weights, the outer product of the 1D weights */
+float* gaussian_weights_2d(int radius, float sigma) {
+	int dim = 2 * radius + 1;
+	float* line = gaussian_weights(radius, sigma);
+	float* weights = (float*)malloc(sizeof(float) * dim * dim);
+
+	for (int i = 0; i < dim; i++)
+		for (int j = 0; j < dim; j++)
+			weights[i * dim + j] = line[i] * line[j];
+
+	free(line);
+	return weights;
+}
+
+/*
+ * Merge adjacent pairs of the dim 1D weights for the linear sampler. Returns
+ * radius + 1 (offset, weight) pairs: a fetch at offset between taps i and i+1
+ * is interpolated in the ratio of their weights, so scaling by their sum
+ * reproduces both taps. An odd last tap is fetched on its own.
+ */
+float* linear_weights(const float* weights, int radius) {
+	int dim = 2 * radius + 1;
+	float* merged = (float*)malloc(sizeof(float) * 2 * (radius + 1));
+	int tap = 0;
+
+	for (int i = 0; i < dim; i += 2) {
+		if (i + 1 < dim) {
+			float total = weights[i] + weights[i + 1];
+			merged[2 * tap] = (i - radius) + weights[i + 1] / total;
+			merged[2 * tap + 1] = total;
+		}
+		else {
+			merged[2 * tap] = (float)(i - radius);
+			merged[2 * tap + 1] = weights[i];
+		}
+		tap++;
+	}
+
+	return merged;
+}
+
+/*
+ * Quantize count normalized weights to FIXED_SHIFT fractional bits. The
+ * rounding residue goes to the largest weight so the fixed-point weights
+ * sum to exactly 1 << FIXED_SHIFT and flat regions come through unchanged.
+ */
+cl_ushort* fixed_weights(const float* weights, int count) {
+	cl_ushort* fixed = (cl_ushort*)malloc(sizeof(cl_ushort) * count);
+	int total = 0, largest = 0;
+
+	for (int i = 0; i < count; i++) {
+		fixed[i] = (cl_ushort)floor(weights[i] * (1 << FIXED_SHIFT) + 0.5);
+		total += fixed[i];
+		if (weights[i] > weights[largest])
+			largest = i;
+	}
+	fixed[largest] = (cl_ushort)(fixed[largest] + (1 << FIXED_SHIFT) - total);
+
+	return fixed;
+}
+
+/*
+ * Young and van Vliet recursive Gaussian coefficients for sigma, returned as
+ * b1/b0, b2/b0, b3/b0 and the gain B. The fit is only valid for sigma >= 0.5.
+ */
+cl_float4 recursive_coefficients(float sigma) {
+	double q, q2, q3, b0, b1, b2, b3;
+	cl_float4 coeff;
+
+	if (sigma < 0.5f)
+		sigma = 0.5f;
+	if (sigma >= 2.5f)
+		q = 0.98711 * sigma - 0.96330;
+	else
+		q = 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+
+	q2 = q * q;
+	q3 = q2 * q;
+	b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+	b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+	b2 = -(1.4281 * q2 + 1.26661 * q3);
+	b3 = 0.422205 * q3;
+
+	coeff.s[0] = (float)(b1 / b0);
+	coeff.s[1] = (float)(b2 / b0);
+	coeff.s[2] = (float)(b3 / b0);
+	coeff.s[3] = (float)(1.0 - (b1 + b2 + b3) / b0);
+	return coeff;
+}
+
+/*
+ * Radii of n box filters whose repeated application approximates a Gaussian
+ * of sigma. The box widths are the two odd integers around the ideal width,
+ * mixed so the summed variance matches sigma squared.
+ */
+void box_radii(float sigma, int n, int* radii) {
+	double ideal = sqrt(12.0 * sigma * sigma / n + 1.0);
+	int lower = (int)floor(ideal);
+	if (lower % 2 == 0)
+		lower--;
+	int upper = lower + 2;
+	double m_ideal = (12.0 * sigma * sigma - n * lower * lower - 4.0 * n * lower - 3.0 * n) /
+		(-4.0 * lower - 4.0);
+	int m = (int)floor(m_ideal + 0.5);
+
+	for (int i = 0; i < n; i++)
+		radii[i] = ((i < m ? lower : upper) - 1) / 2;
+}
+
+/* Smallest power of two no less than n */
+size_t next_pow2(size_t n) {
+	size_t p = 1;
+	while (p < n)
+		p <<= 1;
+	return p;
+}
+
+/* Largest per-channel difference between two frames, ignoring alpha in RGBA frames */
+int max_difference(const unsigned char* a, const unsigned char* b, size_t size, int channels) {
+	int max_diff = 0;
+
+	for (size_t i = 0; i < size * channels; i++) {
+		if (channels == 4 && i % 4 == 3)
+			continue;
+		int diff = abs(a[i] - b[i]);
+		if (diff > max_diff)
+			max_diff = diff;
+	}
+
+	return max_diff;
+}
+
+/* Sigma used when none is given, three sigma either side covers 99.7% of the curve */
+float default_sigma(int radius) {
+	float sigma = radius / 3.0f;
+	if (sigma < 1.0f)
+		sigma = 1.0f;
+	return sigma;
+}
+
+/* True if the context can read and write CL_HALF_FLOAT images with the given channel order */
+bool half_images_supported(cl_context ctx, cl_channel_order order) {
+	cl_image_format* formats;
+	cl_uint num_formats;
+	bool found = false;
+
+	clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+		0, NULL, &num_formats);
+	formats = (cl_image_format*)malloc(sizeof(cl_image_format) * num_formats);
+	clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+		num_formats, formats, NULL);
+	for (cl_uint i = 0; i < num_formats; i++) {
+		if (formats[i].image_channel_order == order &&
+			formats[i].image_channel_data_type == CL_HALF_FLOAT)
+			found = true;
+	}
+
+	free(formats);
+	return found;
+}
+
+/* Wall clock time in nanoseconds, for timings that include host overhead */
+double wall_time() {
+	return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Read the elapsed time of a profiled command in nanoseconds */
+double event_time(cl_event evnt) {
+	cl_ulong time_start, time_end;
+
+	clGetEventProfilingInfo(evnt, CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+	clGetEventProfilingInfo(evnt, CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+
+	return (double)(time_end - time_start);
+}
+
+/*
+ * Cyclic Jacobi eigen-decomposition of the symmetric n x n matrix a. On return
+ * the diagonal of a holds the eigenvalues and column i of v the eigenvector
+ * of a[i][i]. a is overwritten.
+ */
+void jacobi_eigen(double* a, double* v, int n) {
+	for (int i = 0; i < n; i++)
+		for (int j = 0; j < n; j++)
+			v[i * n + j] = (i == j) ? 1.0 : 0.0;
+
+	for (int sweep = 0; sweep < 50; sweep++) {
+		double off = 0;
+		for (int i = 0; i < n; i++)
+			for (int j = i + 1; j < n; j++)
+				off += a[i * n + j] * a[i * n + j];
+		if (off < 1e-22)
+			break;
+
+		for (int p = 0; p < n; p++) {
+			for (int q = p + 1; q < n; q++) {
+				if (a[p * n + q] == 0)
+					continue;
+
+				/* Rotation that zeroes a[p][q] */
+				double theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+				double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+				double c = 1 / sqrt(t * t + 1);
+				double s = t * c;
+
+				for (int k = 0; k < n; k++) {
+					double kp = a[k * n + p], kq = a[k * n + q];
+					a[k * n + p] = c * kp - s * kq;
+					a[k * n + q] = s * kp + c * kq;
+				}
+				for (int k = 0; k < n; k++) {
+					double pk = a[p * n + k], qk = a[q * n + k];
+					a[p * n + k] = c * pk - s * qk;
+					a[q * n + k] = s * pk + c * qk;
+				}
+				for (int k = 0; k < n; k++) {
+					double kp = v[k * n + p], kq = v[k * n + q];
+					v[k * n + p] = c * kp - s * kq;
+					v[k * n + q] = s * kp + c * kq;
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Split the dim x dim row-major kernel into a sum of separable terms from its
+ * singular value decomposition, kernel = sum over k of columns_k * rows_k^T.
+ * columns and rows take dim * MAX_SEPARABLE_RANK weights each, term k at
+ * offset k * dim. Returns the number of terms needed, which may exceed
+ * MAX_SEPARABLE_RANK, in which case only the first MAX_SEPARABLE_RANK are
+ * written.
+ */
+int separable_decompose(const float* kernel, int dim, float* columns, float* rows) {
+	double* a = (double*)malloc(sizeof(double) * dim * dim);
+	double* v = (double*)malloc(sizeof(double) * dim * dim);
+	int* order = (int*)malloc(sizeof(int) * dim);
+	int rank = 0;
+
+	/* Right singular vectors are the eigenvectors of K^T K */
+	for (int i = 0; i < dim; i++) {
+		for (int j = 0; j < dim; j++) {
+			double total = 0;
+			for (int k = 0; k < dim; k++)
+				total += (double)kernel[k * dim + i] * kernel[k * dim + j];
+			a[i * dim + j] = total;
+		}
+	}
+	jacobi_eigen(a, v, dim);
+
+	/* Largest singular values first */
+	for (int i = 0; i < dim; i++)
+		order[i] = i;
+	for (int i = 1; i < dim; i++) {
+		for (int j = i; j > 0 && a[order[j] * dim + order[j]] > a[order[j - 1] * dim + order[j - 1]]; j--) {
+			int tmp = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = tmp;
+		}
+	}
+
+	double largest = sqrt(fmax(a[order[0] * dim + order[0]], 0.0));
+	for (int i = 0; i < dim; i++) {
+		double value = sqrt(fmax(a[order[i] * dim + order[i]], 0.0));
+		if (value <= SEPARABLE_TOLERANCE * largest)
+			break;
+		if (rank < MAX_SEPARABLE_RANK) {
+			/* rows is v_i, columns is K v_i which is the left vector scaled by its singular value */
+			for (int j = 0; j < dim; j++) {
+				double total = 0;
+				for (int k = 0; k < dim; k++)
+					total += kernel[j * dim + k] * v[k * dim + order[i]];
+				rows[rank * dim + j] = (float)v[j * dim + order[i]];
+				columns[rank * dim + j] = (float)total;
+			}
+		}
+		rank++;
+	}
+
+	free(a);
+	free(v);
+	free(order);
+	return rank;
+}
+
+/* A kernel compiled for a single radius */
+struct KernelVariant {
+	const char* name;
+	int radius;
+	cl_kernel kernel;
+};
+
+/*
+ * Owns everything needed to blur frames of one size and format: the context,
+ * queue, kernels and device images are created once and reused for every
+ * call, so each blur only uploads, enqueues and downloads.
+ */
+struct BlurSession {
+	cl_device_id device;
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel naive_kernel, vertical_kernel, horizontal_kernel;
+	cl_kernel vertical_tiled_kernel, horizontal_tiled_kernel;
+	cl_kernel vertical_linear_kernel, horizontal_linear_kernel;
+	cl_kernel naive_blocked_kernel, vertical_blocked_kernel, horizontal_blocked_kernel;
+	cl_kernel vertical_iir_kernel, horizontal_iir_kernel;
+
+	/* Causal pass results of the recursive blur, created on first use */
+	cl_mem iir_scratch;
+
+	/* Summed-area table, created on first use */
+	cl_kernel sat_rows_kernel, sat_columns_kernel, sat_box_kernel, sat_regions_kernel;
+	cl_mem sat_buffer;
+	size_t sat_element, scan_group;
+
+	/* Padded transform buffers and the filter spectrum they were built for */
+	cl_kernel fft_load_kernel, fft_rows_kernel, fft_columns_kernel, fft_multiply_kernel, fft_store_kernel;
+	cl_mem fft_data[2], fft_spectrum;
+	size_t fft_width, fft_height;
+	int fft_radius;
+	float fft_sigma;
+
+	/* General convolution: the float column pass result, the sum of row pass
+	   terms and the decomposition of the last kernel passed to convolve() */
+	cl_kernel conv_rows_kernel, conv_store_kernel;
+	cl_mem conv_image, conv_accumulator;
+	cl_mem conv_2d, conv_columns[MAX_SEPARABLE_RANK], conv_rows[MAX_SEPARABLE_RANK];
+	float* conv_kernel;
+	int conv_dim, conv_rank;
+	size_t tile_size;
+	cl_ulong local_mem_size, constant_size;
+
+	/* Weights for the current radius and sigma, filter_2d is NULL if it exceeds constant memory */
+	cl_mem filter_1d, filter_2d, filter_linear;
+	cl_mem filter_fixed_1d, filter_fixed_2d;
+	int filter_radius;
+	float filter_sigma;
+
+	/* Options shared by every build, the specialized builds add -D RADIUS=n */
+	char build_options[96];
+
+	/* Programs built with -D RADIUS=n indexed by radius, and the kernels taken from them */
+	cl_program radius_programs[MAX_SPECIALIZED_RADIUS + 1];
+	KernelVariant variants[MAX_VARIANTS];
+	int num_variants;
+
+	cl_image_format img_format;
+	size_t width, height;
+	cl_mem input_image, naive_image, vertical_image, output_image;
+
+	/* True when vertical_image holds half floats rather than the frame format */
+	bool half_intermediate;
+
+	/* True for single channel CL_R frames, built with -D GREYSCALE */
+	bool greyscale;
+
+	/* Image arrays for batched blurs, created for batch_layers frames on first use */
+	cl_kernel vertical_array_kernel, horizontal_array_kernel;
+	cl_mem batch_input, batch_vertical, batch_output;
+	size_t batch_layers;
+	cl_image_format intermediate_format;
+
+	/* Kernel events of a blur started by start_blur() */
+	cl_event pending[2];
+
+	/* The same frames as plain uchar4 buffers for the buffer backend */
+	cl_kernel naive_buffer_kernel, vertical_buffer_kernel, horizontal_buffer_kernel;
+	cl_kernel naive_fixed_kernel, vertical_fixed_kernel, horizontal_fixed_kernel;
+	cl_mem input_buffer, naive_result, vertical_result, output_result;
+
+	BlurSession(cl_device_id dev, size_t w, size_t h, cl_image_format format);
+	BlurSession(BlurSession* base, size_t w, size_t h);
+	~BlurSession();
+
+	void create_objects();
+
+	void upload(const unsigned char* input);
+	void download(cl_mem image, unsigned char* output);
+	void set_filter(int radius, float sigma);
+	cl_kernel variant(const char* name, cl_kernel generic, int radius, cl_mem src, cl_mem dst);
+	bool naive_supported(int radius);
+	double naive(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double naive_blocked(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	void prepare_blur(int radius, float sigma = 0);
+	void start_blur(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double finish_blur(cl_ulong* start = NULL, cl_ulong* end = NULL);
+	double blur_tiled(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_linear(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_blocked(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_iir(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_box(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double box(const unsigned char* input, unsigned char* output, int radius);
+	void region_luminance(const unsigned char* input, const cl_int* regions, int count, float* sums);
+	double blur_batch(const unsigned char* inputs, unsigned char* outputs, int count, int radius, float sigma = 0);
+	double convolve(const unsigned char* input, unsigned char* output, const float* kernel, int dim,
+		int* rank = NULL);
+	void set_convolution(const float* kernel, int dim);
+
+	double blur_fft(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double naive_buffer(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_buffer(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double naive_fixed(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double blur_fixed(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	double buffer_one_pass(cl_kernel kernel, const unsigned char* input, unsigned char* output,
+		int radius, cl_mem filter);
+	double buffer_two_pass(cl_kernel first, cl_kernel second, const unsigned char* input,
+		unsigned char* output, int radius, cl_mem filter);
+
+	double build_sat(cl_mem image);
+	void fft_prepare(int radius, float sigma);
+	int fft_transform(int current, float sign, cl_event* events, int* num_events);
+	double box_pass(cl_mem src, cl_mem dst, int radius);
+
+	double one_pass(cl_kernel kernel, const unsigned char* input, unsigned char* output,
+		int radius, size_t block_columns);
+	double two_pass(cl_kernel first, cl_kernel second, const unsigned char* input,
+		unsigned char* output, cl_int size, cl_mem filter, const size_t* local_size,
+		size_t block_rows = 1, size_t block_columns = 1);
+	void enqueue_two_pass(cl_kernel first, cl_kernel second, cl_int size, cl_mem filter,
+		const size_t* local_size, size_t block_rows, size_t block_columns, cl_event* events);
+};
+
+BlurSession::BlurSession(cl_device_id dev, size_t w, size_t h, cl_image_format format) {
+	cl_int err;
+
+	device = dev;
+	width = w;
+	height = h;
+	img_format = format;
+
+	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err < 0) {
+		perror("Couldn't create a context");
+		getchar();
+		exit(1);
+	}
+
+	/* Create a command queue */
+	queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) {
+		perror("Couldn't create a command queue");
+		getchar();
+		exit(1);
+	};
+
+	/* Build the program and create the kernels */
+	greyscale = img_format.image_channel_order == CL_R;
+	sprintf(build_options, "-D PIXELS_PER_ITEM=%d -D FIXED_SHIFT=%d%s%s", PIXELS_PER_ITEM, FIXED_SHIFT,
+		SAT_64BIT ? " -D SAT_64" : "", greyscale ? " -D GREYSCALE" : "");
+	program = build_program(context, device, PROGRAM_FILE, build_options);
+	create_objects();
+}
+
+/*
+ * Session for frames of another size on the same device as base, sharing
+ * its context, queue and programs, including the -D RADIUS builds made so
+ * far, so nothing is compiled again. Only kernels and images are created.
+ */
+BlurSession::BlurSession(BlurSession* base, size_t w, size_t h) {
+	device = base->device;
+	width = w;
+	height = h;
+	img_format = base->img_format;
+	context = base->context;
+	queue = base->queue;
+	program = base->program;
+	clRetainContext(context);
+	clRetainCommandQueue(queue);
+	clRetainProgram(program);
+	greyscale = base->greyscale;
+	strcpy(build_options, base->build_options);
+	create_objects();
+
+	for (int i = 0; i <= MAX_SPECIALIZED_RADIUS; i++) {
+		radius_programs[i] = base->radius_programs[i];
+		if (radius_programs[i] != NULL)
+			clRetainProgram(radius_programs[i]);
+	}
+}
+
+/* Kernels, images and state for the session size, once the program is built */
+void BlurSession::create_objects() {
+	cl_int err;
+
+	naive_kernel = clCreateKernel(program, KERNEL_FUNC_1, &err);
+	vertical_kernel = clCreateKernel(program, KERNEL_FUNC_2a, &err);
+	horizontal_kernel = clCreateKernel(program, KERNEL_FUNC_2b, &err);
+	vertical_tiled_kernel = clCreateKernel(program, KERNEL_FUNC_3a, &err);
+	horizontal_tiled_kernel = clCreateKernel(program, KERNEL_FUNC_3b, &err);
+	vertical_linear_kernel = clCreateKernel(program, KERNEL_FUNC_4a, &err);
+	horizontal_linear_kernel = clCreateKernel(program, KERNEL_FUNC_4b, &err);
+	naive_blocked_kernel = clCreateKernel(program, KERNEL_FUNC_5, &err);
+	vertical_blocked_kernel = clCreateKernel(program, KERNEL_FUNC_5a, &err);
+	horizontal_blocked_kernel = clCreateKernel(program, KERNEL_FUNC_5b, &err);
+	vertical_iir_kernel = clCreateKernel(program, KERNEL_FUNC_6a, &err);
+	horizontal_iir_kernel = clCreateKernel(program, KERNEL_FUNC_6b, &err);
+	sat_rows_kernel = clCreateKernel(program, KERNEL_SAT_ROWS, &err);
+	sat_columns_kernel = clCreateKernel(program, KERNEL_SAT_COLUMNS, &err);
+	sat_box_kernel = clCreateKernel(program, KERNEL_SAT_BOX, &err);
+	sat_regions_kernel = clCreateKernel(program, KERNEL_SAT_REGIONS, &err);
+	fft_load_kernel = clCreateKernel(program, KERNEL_FFT_LOAD, &err);
+	fft_rows_kernel = clCreateKernel(program, KERNEL_FFT_ROWS, &err);
+	fft_columns_kernel = clCreateKernel(program, KERNEL_FFT_COLUMNS, &err);
+	fft_multiply_kernel = clCreateKernel(program, KERNEL_FFT_MULTIPLY, &err);
+	fft_store_kernel = clCreateKernel(program, KERNEL_FFT_STORE, &err);
+	conv_rows_kernel = clCreateKernel(program, KERNEL_CONV_ROWS, &err);
+	conv_store_kernel = clCreateKernel(program, KERNEL_CONV_STORE, &err);
+	naive_buffer_kernel = clCreateKernel(program, KERNEL_BUF_NAIVE, &err);
+	vertical_buffer_kernel = clCreateKernel(program, KERNEL_BUF_VERTICAL, &err);
+	horizontal_buffer_kernel = clCreateKernel(program, KERNEL_BUF_HORIZONTAL, &err);
+	naive_fixed_kernel = clCreateKernel(program, KERNEL_FIXED_NAIVE, &err);
+	vertical_fixed_kernel = clCreateKernel(program, KERNEL_FIXED_VERTICAL, &err);
+	horizontal_fixed_kernel = clCreateKernel(program, KERNEL_FIXED_HORIZONTAL, &err);
+	vertical_array_kernel = clCreateKernel(program, KERNEL_ARRAY_VERTICAL, &err);
+	horizontal_array_kernel = clCreateKernel(program, KERNEL_ARRAY_HORIZONTAL, &err);
+	if (err < 0) {
+		printf("Couldn't create a kernel: %d", err);
+		getchar();
+		exit(1);
+	};
+
+	/* Create image objects */
+	input_image = clCreateImage2D(context, CL_MEM_READ_ONLY,
+		&img_format, width, height, 0, NULL, &err);
+	/* Readable so stacked box passes can use it as a frame format intermediate */
+	naive_image = clCreateImage2D(context, CL_MEM_READ_WRITE,
+		&img_format, width, height, 0, NULL, &err);
+	/* The vertical pass result stays on the device as the horizontal input,
+	   at half precision when possible so it is not rounded to 8 bits */
+	intermediate_format = img_format;
+	half_intermediate = HALF_INTERMEDIATES && half_images_supported(context, img_format.image_channel_order);
+	if (half_intermediate)
+		intermediate_format.image_channel_data_type = CL_HALF_FLOAT;
+	vertical_image = clCreateImage2D(context, CL_MEM_READ_WRITE,
+		&intermediate_format, width, height, 0, NULL, &err);
+	output_image = clCreateImage2D(context, CL_MEM_READ_WRITE,
+		&img_format, width, height, 0, NULL, &err);
+	if (err < 0) {
+		perror("Couldn't create the image object");
+		exit(1);
+	};
+
+	input_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY,
+		4 * width * height, NULL, &err);
+	naive_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+		4 * width * height, NULL, &err);
+	vertical_result = clCreateBuffer(context, CL_MEM_READ_WRITE,
+		4 * width * height, NULL, &err);
+	output_result = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+		4 * width * height, NULL, &err);
+	if (err < 0) {
+		perror("Couldn't create a buffer");
+		exit(1);
+	};
+
+	/* Image arguments never change, only the filter size does */
+	err = clSetKernelArg(naive_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(naive_kernel, 1, sizeof(cl_mem), &naive_image);
+	err |= clSetKernelArg(vertical_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(vertical_kernel, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_kernel, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_kernel, 1, sizeof(cl_mem), &output_image);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		getchar();
+		exit(1);
+	};
+
+	err = clSetKernelArg(vertical_tiled_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(vertical_tiled_kernel, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_tiled_kernel, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_tiled_kernel, 1, sizeof(cl_mem), &output_image);
+	err |= clSetKernelArg(vertical_linear_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(vertical_linear_kernel, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_linear_kernel, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_linear_kernel, 1, sizeof(cl_mem), &output_image);
+	err |= clSetKernelArg(naive_blocked_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(naive_blocked_kernel, 1, sizeof(cl_mem), &naive_image);
+	err |= clSetKernelArg(vertical_blocked_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(vertical_blocked_kernel, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_blocked_kernel, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_blocked_kernel, 1, sizeof(cl_mem), &output_image);
+	err |= clSetKernelArg(vertical_iir_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(vertical_iir_kernel, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_iir_kernel, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(horizontal_iir_kernel, 1, sizeof(cl_mem), &output_image);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		getchar();
+		exit(1);
+	};
+
+	/* Shrink the tile until a square work-group fits both tiled kernels */
+	size_t max_group, max_group_b;
+	clGetKernelWorkGroupInfo(vertical_tiled_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max_group), &max_group, NULL);
+	clGetKernelWorkGroupInfo(horizontal_tiled_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max_group_b), &max_group_b, NULL);
+	if (max_group_b < max_group)
+		max_group = max_group_b;
+	tile_size = TILE_SIZE;
+	while (tile_size > 1 && tile_size * tile_size > max_group)
+		tile_size /= 2;
+
+	clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+		sizeof(local_mem_size), &local_mem_size, NULL);
+	clGetDeviceInfo(device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+		sizeof(constant_size), &constant_size, NULL);
+
+	filter_1d = NULL;
+	filter_2d = NULL;
+	filter_linear = NULL;
+	filter_fixed_1d = NULL;
+	filter_fixed_2d = NULL;
+	iir_scratch = NULL;
+	sat_buffer = NULL;
+	fft_data[0] = NULL;
+	fft_data[1] = NULL;
+	fft_spectrum = NULL;
+	fft_width = 0;
+	fft_height = 0;
+	fft_radius = -1;
+	fft_sigma = 0;
+	conv_image = NULL;
+	conv_accumulator = NULL;
+	conv_2d = NULL;
+	for (int i = 0; i < MAX_SEPARABLE_RANK; i++) {
+		conv_columns[i] = NULL;
+		conv_rows[i] = NULL;
+	}
+	conv_kernel = NULL;
+	conv_dim = 0;
+	batch_input = NULL;
+	batch_vertical = NULL;
+	batch_output = NULL;
+	batch_layers = 0;
+	conv_rank = 0;
+	sat_element = SAT_64BIT ? 4 * sizeof(cl_ulong) : 4 * sizeof(cl_uint);
+
+	clGetKernelWorkGroupInfo(sat_rows_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max_group), &max_group, NULL);
+	scan_group = SCAN_GROUP_SIZE;
+	while (scan_group > 1 && scan_group > max_group)
+		scan_group /= 2;
+	filter_radius = -1;
+	filter_sigma = 0;
+
+	for (int i = 0; i <= MAX_SPECIALIZED_RADIUS; i++)
+		radius_programs[i] = NULL;
+	num_variants = 0;
+}
+
+BlurSession::~BlurSession() {
+	if (filter_1d != NULL)
+		clReleaseMemObject(filter_1d);
+	if (filter_2d != NULL)
+		clReleaseMemObject(filter_2d);
+	if (filter_linear != NULL)
+		clReleaseMemObject(filter_linear);
+	if (filter_fixed_1d != NULL)
+		clReleaseMemObject(filter_fixed_1d);
+	if (filter_fixed_2d != NULL)
+		clReleaseMemObject(filter_fixed_2d);
+	if (iir_scratch != NULL)
+		clReleaseMemObject(iir_scratch);
+	if (sat_buffer != NULL)
+		clReleaseMemObject(sat_buffer);
+	if (fft_spectrum != NULL) {
+		clReleaseMemObject(fft_data[0]);
+		clReleaseMemObject(fft_data[1]);
+		clReleaseMemObject(fft_spectrum);
+	}
+	if (conv_image != NULL) {
+		clReleaseMemObject(conv_image);
+		clReleaseMemObject(conv_accumulator);
+	}
+	if (conv_2d != NULL)
+		clReleaseMemObject(conv_2d);
+	for (int i = 0; i < MAX_SEPARABLE_RANK; i++) {
+		if (conv_columns[i] != NULL) {
+			clReleaseMemObject(conv_columns[i]);
+			clReleaseMemObject(conv_rows[i]);
+		}
+	}
+	free(conv_kernel);
+	if (batch_input != NULL) {
+		clReleaseMemObject(batch_input);
+		clReleaseMemObject(batch_vertical);
+		clReleaseMemObject(batch_output);
+	}
+	clReleaseMemObject(input_buffer);
+	clReleaseMemObject(naive_result);
+	clReleaseMemObject(vertical_result);
+	clReleaseMemObject(output_result);
+	clReleaseMemObject(input_image);
+	clReleaseMemObject(naive_image);
+	clReleaseMemObject(vertical_image);
+	clReleaseMemObject(output_image);
+	clReleaseKernel(naive_kernel);
+	clReleaseKernel(vertical_kernel);
+	clReleaseKernel(horizontal_kernel);
+	clReleaseKernel(vertical_tiled_kernel);
+	clReleaseKernel(horizontal_tiled_kernel);
+	clReleaseKernel(vertical_linear_kernel);
+	clReleaseKernel(horizontal_linear_kernel);
+	clReleaseKernel(naive_blocked_kernel);
+	clReleaseKernel(vertical_blocked_kernel);
+	clReleaseKernel(horizontal_blocked_kernel);
+	clReleaseKernel(vertical_iir_kernel);
+	clReleaseKernel(horizontal_iir_kernel);
+	clReleaseKernel(sat_rows_kernel);
+	clReleaseKernel(sat_columns_kernel);
+	clReleaseKernel(sat_box_kernel);
+	clReleaseKernel(sat_regions_kernel);
+	clReleaseKernel(fft_load_kernel);
+	clReleaseKernel(fft_rows_kernel);
+	clReleaseKernel(fft_columns_kernel);
+	clReleaseKernel(fft_multiply_kernel);
+	clReleaseKernel(fft_store_kernel);
+	clReleaseKernel(conv_rows_kernel);
+	clReleaseKernel(conv_store_kernel);
+	clReleaseKernel(naive_buffer_kernel);
+	clReleaseKernel(vertical_buffer_kernel);
+	clReleaseKernel(horizontal_buffer_kernel);
+	clReleaseKernel(naive_fixed_kernel);
+	clReleaseKernel(vertical_fixed_kernel);
+	clReleaseKernel(horizontal_fixed_kernel);
+	clReleaseKernel(vertical_array_kernel);
+	clReleaseKernel(horizontal_array_kernel);
+	for (int i = 0; i < num_variants; i++)
+		clReleaseKernel(variants[i].kernel);
+	for (int i = 0; i <= MAX_SPECIALIZED_RADIUS; i++)
+		if (radius_programs[i] != NULL)
+			clReleaseProgram(radius_programs[i]);
+	clReleaseCommandQueue(queue);
+	clReleaseProgram(program);
+	clReleaseContext(context);
+}
+
+/* True if the dim x dim weights of the naive kernel fit in constant memory */
+bool BlurSession::naive_supported(int radius) {
+	size_t dim = 2 * radius + 1;
+	return sizeof(float) * dim * dim <= constant_size;
+}
+
+/* Generate and upload the weights for radius and sigma, only when they change */
+void BlurSession::set_filter(int radius, float sigma) {
+	cl_int dim = 2 * radius + 1;
+	cl_int err;
+
+	if (sigma <= 0)
+		sigma = default_sigma(radius);
+	if (radius == filter_radius && sigma == filter_sigma)
+		return;
+
+	if (filter_1d != NULL)
+		clReleaseMemObject(filter_1d);
+	if (filter_2d != NULL)
+		clReleaseMemObject(filter_2d);
+	if (filter_linear != NULL)
+		clReleaseMemObject(filter_linear);
+	if (filter_fixed_1d != NULL)
+		clReleaseMemObject(filter_fixed_1d);
+	if (filter_fixed_2d != NULL)
+		clReleaseMemObject(filter_fixed_2d);
+	filter_2d = NULL;
+	filter_fixed_2d = NULL;
+
+	float* weights = gaussian_weights(radius, sigma);
+	float* merged = linear_weights(weights, radius);
+	cl_ushort* fixed = fixed_weights(weights, dim);
+	filter_1d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * dim, weights, &err);
+	filter_linear = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * 2 * (radius + 1), merged, &err);
+	filter_fixed_1d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_ushort) * dim, fixed, &err);
+	free(weights);
+	free(merged);
+	free(fixed);
+	if (err < 0) {
+		perror("Couldn't create a buffer");
+		exit(1);
+	};
+
+	if (naive_supported(radius)) {
+		weights = gaussian_weights_2d(radius, sigma);
+		fixed = fixed_weights(weights, dim * dim);
+		filter_2d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * dim * dim, weights, &err);
+		filter_fixed_2d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(cl_ushort) * dim * dim, fixed, &err);
+		free(weights);
+		free(fixed);
+		if (err < 0) {
+			perror("Couldn't create a buffer");
+			exit(1);
+		};
+	}
+
+	filter_radius = radius;
+	filter_sigma = sigma;
+}
+
+/*
+ * Return the kernel called name compiled for radius, building the program
+ * with -D RADIUS on first use and caching the kernel for later calls. src and
+ * dst are bound once when the kernel is created. Falls back to the generic
+ * kernel past MAX_SPECIALIZED_RADIUS or once the cache is full.
+ */
+cl_kernel BlurSession::variant(const char* name, cl_kernel generic, int radius, cl_mem src, cl_mem dst) {
+	char options[128];
+	cl_kernel kernel;
+	cl_int err;
+
+	if (!SPECIALIZE_RADIUS || radius > MAX_SPECIALIZED_RADIUS)
+		return generic;
+
+	for (int i = 0; i < num_variants; i++) {
+		if (variants[i].radius == radius && strcmp(variants[i].name, name) == 0)
+			return variants[i].kernel;
+	}
+	if (num_variants == MAX_VARIANTS)
+		return generic;
+
+	if (radius_programs[radius] == NULL) {
+		sprintf(options, "%s -D RADIUS=%d", build_options, radius);
+		radius_programs[radius] = build_program(context, device, PROGRAM_FILE, options);
+	}
+
+	kernel = clCreateKernel(radius_programs[radius], name, &err);
+	if (err < 0) {
+		printf("Couldn't create a kernel: %d", err);
+		exit(1);
+	};
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &src);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &dst);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	variants[num_variants].name = name;
+	variants[num_variants].radius = radius;
+	variants[num_variants].kernel = kernel;
+	num_variants++;
+
+	return kernel;
+}
+
+/* Copy a host RGBA frame into the session's input image */
+void BlurSession::upload(const unsigned char* input) {
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, 1 };
+	cl_int err;
+
+	err = clEnqueueWriteImage(queue, input_image, CL_FALSE, origin,
+		region, 0, 0, (const void*)input, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't write to the image object");
+		exit(1);
+	}
+}
+
+/* Blocking read of a whole device image into host memory, only images in
+   the frame format fit the host frame */
+void BlurSession::download(cl_mem image, unsigned char* output) {
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, 1 };
+	cl_int err;
+
+	if (image == vertical_image) {
+		printf("The intermediate image can't be read into a frame\n");
+		exit(1);
+	}
+
+	err = clEnqueueReadImage(queue, image, CL_TRUE, origin,
+		region, 0, 0, (void*)output, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read from the image object");
+		exit(1);
+	}
+}
+
+/*
+ * Run a 2D blur kernel with the dim x dim weights, returns the kernel time in
+ * nanoseconds. Each work-item covers block_columns pixels of a row.
+ */
+double BlurSession::one_pass(cl_kernel kernel, const unsigned char* input, unsigned char* output,
+	int radius, size_t block_columns) {
+	size_t global_size[2] = { (width + block_columns - 1) / block_columns, height };
+	cl_int dim = 2 * radius + 1;
+	cl_event evnt;
+	cl_int err;
+	double time;
+
+	if (filter_2d == NULL) {
+		printf("Radius %d is too large for the naive kernel\n", radius);
+		exit(1);
+	}
+
+	upload(input);
+
+	err = clSetKernelArg(kernel, 2, sizeof(cl_int), &dim);
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &filter_2d);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size,
+		NULL, 0, NULL, &evnt);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	download(naive_image, output);
+
+	clWaitForEvents(1, &evnt);
+	time = event_time(evnt);
+	clReleaseEvent(evnt);
+
+	return time;
+}
+
+/* Single pass 2D blur, returns the kernel time in nanoseconds */
+double BlurSession::naive(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return one_pass(variant(KERNEL_FUNC_1, naive_kernel, radius, input_image, naive_image),
+		input, output, radius, 1);
+}
+
+/* Single pass 2D blur computing a run of pixels per work-item */
+double BlurSession::naive_blocked(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return one_pass(variant(KERNEL_FUNC_5, naive_blocked_kernel, radius, input_image, naive_image),
+		input, output, radius, PIXELS_PER_ITEM);
+}
+
+/*
+ * Run a vertical then horizontal pass, returns the summed kernel time in
+ * nanoseconds. size and filter are passed as arguments 2 and 3 of both
+ * kernels. Each work-item of the first pass covers block_rows pixels of a
+ * column and each of the second pass block_columns pixels of a row.
+ * local_size may be NULL to let the runtime pick, otherwise the global
+ * size is rounded up to a multiple of it.
+ */
+double BlurSession::two_pass(cl_kernel first, cl_kernel second, const unsigned char* input,
+	unsigned char* output, cl_int size, cl_mem filter, const size_t* local_size,
+	size_t block_rows, size_t block_columns) {
+	cl_event evnts[2];
+	double time;
+
+	upload(input);
+	enqueue_two_pass(first, second, size, filter, local_size, block_rows, block_columns, evnts);
+	download(output_image, output);
+
+	clWaitForEvents(2, evnts);
+	time = event_time(evnts[0]) + event_time(evnts[1]);
+	clReleaseEvent(evnts[0]);
+	clReleaseEvent(evnts[1]);
+
+	return time;
+}
+
+/* Set the filter arguments and enqueue both passes, events receives the kernel events */
+void BlurSession::enqueue_two_pass(cl_kernel first, cl_kernel second, cl_int size, cl_mem filter,
+	const size_t* local_size, size_t block_rows, size_t block_columns, cl_event* events) {
+	size_t first_size[2] = { width, (height + block_rows - 1) / block_rows };
+	size_t second_size[2] = { (width + block_columns - 1) / block_columns, height };
+	cl_int err;
+
+	if (local_size != NULL) {
+		for (int i = 0; i < 2; i++) {
+			first_size[i] = (first_size[i] + local_size[i] - 1) / local_size[i] * local_size[i];
+			second_size[i] = (second_size[i] + local_size[i] - 1) / local_size[i] * local_size[i];
+		}
+	}
+
+	err = clSetKernelArg(first, 2, sizeof(cl_int), &size);
+	err |= clSetKernelArg(first, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(second, 2, sizeof(cl_int), &size);
+	err |= clSetKernelArg(second, 3, sizeof(cl_mem), &filter);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, first, 2, NULL, first_size,
+		local_size, 0, NULL, &events[0]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	/* Second pass only waits on the first, the intermediate never leaves the device */
+	err = clEnqueueNDRangeKernel(queue, second, 2, NULL, second_size,
+		local_size, 1, &events[0], &events[1]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+}
+
+/* Separable two pass blur, returns the summed kernel time in nanoseconds */
+double BlurSession::blur(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return two_pass(variant(KERNEL_FUNC_2a, vertical_kernel, radius, input_image, vertical_image),
+		variant(KERNEL_FUNC_2b, horizontal_kernel, radius, vertical_image, output_image),
+		input, output, 2 * radius + 1, filter_1d, NULL);
+}
+
+/* Upload the weights and create the -D RADIUS kernels of the two pass blur
+   ahead of start_blur(), so starting it enqueues without compiling */
+void BlurSession::prepare_blur(int radius, float sigma) {
+	set_filter(radius, sigma);
+	variant(KERNEL_FUNC_2a, vertical_kernel, radius, input_image, vertical_image);
+	variant(KERNEL_FUNC_2b, horizontal_kernel, radius, vertical_image, output_image);
+}
+
+/*
+ * Enqueue blur() with a non-blocking read and return at once, so blurs on
+ * several sessions can run at the same time. output must stay valid until
+ * finish_blur(), which waits for the read and returns the kernel time.
+ */
+void BlurSession::start_blur(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, 1 };
+	cl_int err;
+
+	prepare_blur(radius, sigma);
+	upload(input);
+	enqueue_two_pass(variant(KERNEL_FUNC_2a, vertical_kernel, radius, input_image, vertical_image),
+		variant(KERNEL_FUNC_2b, horizontal_kernel, radius, vertical_image, output_image),
+		2 * radius + 1, filter_1d, NULL, 1, 1, pending);
+
+	err = clEnqueueReadImage(queue, output_image, CL_FALSE, origin,
+		region, 0, 0, (void*)output, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read from the image object");
+		exit(1);
+	}
+	clFlush(queue);
+}
+
+/* start and end, when given, receive the device timestamps of the first and last kernel */
+double BlurSession::finish_blur(cl_ulong* start, cl_ulong* end) {
+	double time;
+
+	clFinish(queue);
+	time = event_time(pending[0]) + event_time(pending[1]);
+	if (start != NULL)
+		clGetEventProfilingInfo(pending[0], CL_PROFILING_COMMAND_START, sizeof(*start), start, NULL);
+	if (end != NULL)
+		clGetEventProfilingInfo(pending[1], CL_PROFILING_COMMAND_END, sizeof(*end), end, NULL);
+	clReleaseEvent(pending[0]);
+	clReleaseEvent(pending[1]);
+
+	return time;
+}
+
+/*
+ * Separable blur staging tiles in local memory. Large radii shrink the tile
+ * until it fits, falling back to blur() once the halo would dominate it.
+ */
+double BlurSession::blur_tiled(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	size_t tile = tile_size;
+	size_t tile_bytes = sizeof(cl_float4) * (tile + 2 * radius) * tile;
+	cl_int err;
+
+	while (tile > 4 && tile_bytes > local_mem_size) {
+		tile /= 2;
+		tile_bytes = sizeof(cl_float4) * (tile + 2 * radius) * tile;
+	}
+	if (tile_bytes > local_mem_size)
+		return blur(input, output, radius, sigma);
+
+	size_t local_size[2] = { tile, tile };
+
+	cl_kernel first = variant(KERNEL_FUNC_3a, vertical_tiled_kernel, radius, input_image, vertical_image);
+	cl_kernel second = variant(KERNEL_FUNC_3b, horizontal_tiled_kernel, radius, vertical_image, output_image);
+
+	set_filter(radius, sigma);
+	err = clSetKernelArg(first, 4, tile_bytes, NULL);
+	err |= clSetKernelArg(second, 4, tile_bytes, NULL);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	return two_pass(first, second, input, output, 2 * radius + 1, filter_1d, local_size);
+}
+
+/* Separable blur fetching two taps per read through the linear sampler */
+double BlurSession::blur_linear(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return two_pass(variant(KERNEL_FUNC_4a, vertical_linear_kernel, radius, input_image, vertical_image),
+		variant(KERNEL_FUNC_4b, horizontal_linear_kernel, radius, vertical_image, output_image),
+		input, output, radius + 1, filter_linear, NULL);
+}
+
+/* Separable blur computing a run of pixels along each pass per work-item */
+double BlurSession::blur_blocked(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return two_pass(variant(KERNEL_FUNC_5a, vertical_blocked_kernel, radius, input_image, vertical_image),
+		variant(KERNEL_FUNC_5b, horizontal_blocked_kernel, radius, vertical_image, output_image),
+		input, output, 2 * radius + 1, filter_1d, NULL, PIXELS_PER_ITEM, PIXELS_PER_ITEM);
+}
+
+/*
+ * Recursive Gaussian, each pass runs one work-item per column then per row
+ * so the cost is independent of radius. Only sigma matters, radius is used
+ * to pick the default sigma. Returns the summed kernel time in nanoseconds.
+ */
+double BlurSession::blur_iir(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	size_t columns = width, rows = height;
+	cl_float4 coeff;
+	cl_event evnt_a, evnt_b;
+	cl_int err;
+	double time;
+
+	if (sigma <= 0)
+		sigma = default_sigma(radius);
+	coeff = recursive_coefficients(sigma);
+
+	if (iir_scratch == NULL) {
+		iir_scratch = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(cl_float4) * width * height, NULL, &err);
+		if (err < 0) {
+			perror("Couldn't create a buffer");
+			exit(1);
+		};
+	}
+
+	upload(input);
+
+	err = clSetKernelArg(vertical_iir_kernel, 2, sizeof(cl_mem), &iir_scratch);
+	err |= clSetKernelArg(vertical_iir_kernel, 3, sizeof(cl_float4), &coeff);
+	err |= clSetKernelArg(horizontal_iir_kernel, 2, sizeof(cl_mem), &iir_scratch);
+	err |= clSetKernelArg(horizontal_iir_kernel, 3, sizeof(cl_float4), &coeff);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, vertical_iir_kernel, 1, NULL, &columns,
+		NULL, 0, NULL, &evnt_a);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	err = clEnqueueNDRangeKernel(queue, horizontal_iir_kernel, 1, NULL, &rows,
+		NULL, 1, &evnt_a, &evnt_b);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	download(output_image, output);
+
+	clWaitForEvents(1, &evnt_a);
+	clWaitForEvents(1, &evnt_b);
+	time = event_time(evnt_a) + event_time(evnt_b);
+	clReleaseEvent(evnt_a);
+	clReleaseEvent(evnt_b);
+
+	return time;
+}
+
+/* Build the summed-area table of image, returns the kernel time in nanoseconds */
+double BlurSession::build_sat(cl_mem image) {
+	size_t row_size[2] = { scan_group, height };
+	size_t row_local[2] = { scan_group, 1 };
+	size_t columns = width;
+	cl_int w = (cl_int)width, h = (cl_int)height;
+	cl_event evnt_a, evnt_b;
+	cl_int err;
+	double time;
+
+	if (sat_buffer == NULL) {
+		sat_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sat_element * width * height, NULL, &err);
+		if (err < 0) {
+			perror("Couldn't create a buffer");
+			exit(1);
+		};
+	}
+
+	err = clSetKernelArg(sat_rows_kernel, 0, sizeof(cl_mem), &image);
+	err |= clSetKernelArg(sat_rows_kernel, 1, sizeof(cl_mem), &sat_buffer);
+	err |= clSetKernelArg(sat_rows_kernel, 2, sat_element * scan_group, NULL);
+	err |= clSetKernelArg(sat_columns_kernel, 0, sizeof(cl_mem), &sat_buffer);
+	err |= clSetKernelArg(sat_columns_kernel, 1, sizeof(cl_int), &w);
+	err |= clSetKernelArg(sat_columns_kernel, 2, sizeof(cl_int), &h);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, sat_rows_kernel, 2, NULL, row_size,
+		row_local, 0, NULL, &evnt_a);
+	err |= clEnqueueNDRangeKernel(queue, sat_columns_kernel, 1, NULL, &columns,
+		NULL, 1, &evnt_a, &evnt_b);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	clWaitForEvents(1, &evnt_b);
+	time = event_time(evnt_a) + event_time(evnt_b);
+	clReleaseEvent(evnt_a);
+	clReleaseEvent(evnt_b);
+
+	return time;
+}
+
+/* One constant time box blur from src to dst through the summed-area table */
+double BlurSession::box_pass(cl_mem src, cl_mem dst, int radius) {
+	size_t global_size[2] = { width, height };
+	cl_event evnt;
+	cl_int err;
+	double time;
+
+	time = build_sat(src);
+
+	err = clSetKernelArg(sat_box_kernel, 0, sizeof(cl_mem), &sat_buffer);
+	err |= clSetKernelArg(sat_box_kernel, 1, sizeof(cl_mem), &dst);
+	err |= clSetKernelArg(sat_box_kernel, 2, sizeof(cl_int), &radius);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, sat_box_kernel, 2, NULL, global_size,
+		NULL, 0, NULL, &evnt);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	clWaitForEvents(1, &evnt);
+	time += event_time(evnt);
+	clReleaseEvent(evnt);
+
+	return time;
+}
+
+/* Box blur of any radius at constant cost, returns the kernel time in nanoseconds */
+double BlurSession::box(const unsigned char* input, unsigned char* output, int radius) {
+	double time;
+
+	upload(input);
+	time = box_pass(input_image, output_image, radius);
+	download(output_image, output);
+
+	return time;
+}
+
+/*
+ * Gaussian approximated by BOX_PASSES stacked box blurs, each costing the
+ * same whatever its radius. Only sigma matters, radius picks the default.
+ * Passes alternate between vertical_image and naive_image, the last one
+ * always writes output_image so the frame is read back in its own format.
+ */
+double BlurSession::blur_box(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	int radii[BOX_PASSES];
+	cl_mem src = input_image, dst;
+	double time = 0;
+
+	if (sigma <= 0)
+		sigma = default_sigma(radius);
+	box_radii(sigma, BOX_PASSES, radii);
+
+	upload(input);
+	for (int i = 0; i < BOX_PASSES; i++) {
+		if (i == BOX_PASSES - 1)
+			dst = output_image;
+		else
+			dst = (i % 2 == 0) ? vertical_image : naive_image;
+		time += box_pass(src, dst, radii[i]);
+		src = dst;
+	}
+	download(output_image, output);
+
+	return time;
+}
+
+/*
+ * Luminance sums of count inclusive (x0, y0, x1, y1) regions of input, in
+ * 0-255 units, each answered from the summed-area table in four lookups.
+ */
+void BlurSession::region_luminance(const unsigned char* input, const cl_int* regions, int count, float* sums) {
+	size_t global_size = count;
+	cl_int w = (cl_int)width;
+	cl_mem region_buffer, sum_buffer;
+	cl_int err;
+
+	upload(input);
+	build_sat(input_image);
+
+	region_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(cl_int) * 4 * count, (void*)regions, &err);
+	sum_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+		sizeof(float) * count, NULL, &err);
+	if (err < 0) {
+		perror("Couldn't create a buffer");
+		exit(1);
+	};
+
+	err = clSetKernelArg(sat_regions_kernel, 0, sizeof(cl_mem), &sat_buffer);
+	err |= clSetKernelArg(sat_regions_kernel, 1, sizeof(cl_int), &w);
+	err |= clSetKernelArg(sat_regions_kernel, 2, sizeof(cl_mem), &region_buffer);
+	err |= clSetKernelArg(sat_regions_kernel, 3, sizeof(cl_mem), &sum_buffer);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, sat_regions_kernel, 1, NULL, &global_size,
+		NULL, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	err = clEnqueueReadBuffer(queue, sum_buffer, CL_TRUE, 0,
+		sizeof(float) * count, sums, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read the buffer");
+		exit(1);
+	}
+
+	clReleaseMemObject(region_buffer);
+	clReleaseMemObject(sum_buffer);
+}
+
+/*
+ * Run every radix-2 pass of a 2D transform, rows then columns, ping-ponging
+ * between the two fft_data buffers starting from fft_data[current]. The pass
+ * events are appended to events. Returns the index holding the result.
+ */
+int BlurSession::fft_transform(int current, float sign, cl_event* events, int* num_events) {
+	size_t row_size[2] = { fft_width / 2, fft_height };
+	size_t column_size[2] = { fft_width, fft_height / 2 };
+	cl_int n, p, padded_width = (cl_int)fft_width;
+	cl_int err;
+
+	n = (cl_int)fft_width;
+	for (p = 1; p < n; p <<= 1) {
+		err = clSetKernelArg(fft_rows_kernel, 0, sizeof(cl_mem), &fft_data[current]);
+		err |= clSetKernelArg(fft_rows_kernel, 1, sizeof(cl_mem), &fft_data[1 - current]);
+		err |= clSetKernelArg(fft_rows_kernel, 2, sizeof(cl_int), &n);
+		err |= clSetKernelArg(fft_rows_kernel, 3, sizeof(cl_int), &p);
+		err |= clSetKernelArg(fft_rows_kernel, 4, sizeof(float), &sign);
+		err |= clEnqueueNDRangeKernel(queue, fft_rows_kernel, 2, NULL, row_size,
+			NULL, 0, NULL, &events[(*num_events)++]);
+		if (err < 0) {
+			perror("Couldn't enqueue the kernel");
+			exit(1);
+		}
+		current = 1 - current;
+	}
+
+	n = (cl_int)fft_height;
+	for (p = 1; p < n; p <<= 1) {
+		err = clSetKernelArg(fft_columns_kernel, 0, sizeof(cl_mem), &fft_data[current]);
+		err |= clSetKernelArg(fft_columns_kernel, 1, sizeof(cl_mem), &fft_data[1 - current]);
+		err |= clSetKernelArg(fft_columns_kernel, 2, sizeof(cl_int), &n);
+		err |= clSetKernelArg(fft_columns_kernel, 3, sizeof(cl_int), &p);
+		err |= clSetKernelArg(fft_columns_kernel, 4, sizeof(cl_int), &padded_width);
+		err |= clSetKernelArg(fft_columns_kernel, 5, sizeof(float), &sign);
+		err |= clEnqueueNDRangeKernel(queue, fft_columns_kernel, 2, NULL, column_size,
+			NULL, 0, NULL, &events[(*num_events)++]);
+		if (err < 0) {
+			perror("Couldn't enqueue the kernel");
+			exit(1);
+		}
+		current = 1 - current;
+	}
+
+	return current;
+}
+
+/*
+ * Size the padded buffers for radius and transform the filter for radius and
+ * sigma. Both are kept until the padded size or the filter changes.
+ */
+void BlurSession::fft_prepare(int radius, float sigma) {
+	size_t padded_width = next_pow2(width + 2 * radius);
+	size_t padded_height = next_pow2(height + 2 * radius);
+	size_t padded_size = padded_width * padded_height;
+	cl_event events[128];
+	int num_events = 0;
+	cl_int err;
+
+	if (sigma <= 0)
+		sigma = default_sigma(radius);
+
+	if (padded_width != fft_width || padded_height != fft_height) {
+		if (fft_spectrum != NULL) {
+			clReleaseMemObject(fft_data[0]);
+			clReleaseMemObject(fft_data[1]);
+			clReleaseMemObject(fft_spectrum);
+		}
+		fft_data[0] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(cl_float4) * padded_size, NULL, &err);
+		fft_data[1] = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(cl_float4) * padded_size, NULL, &err);
+		fft_spectrum = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(cl_float4) * padded_size, NULL, &err);
+		if (err < 0) {
+			perror("Couldn't create a buffer");
+			exit(1);
+		};
+		fft_width = padded_width;
+		fft_height = padded_height;
+		fft_radius = -1;
+	}
+
+	if (radius == fft_radius && sigma == fft_sigma)
+		return;
+
+	/* Filter centred on the origin, negative offsets wrap to the far edges */
+	int dim = 2 * radius + 1;
+	float* weights = gaussian_weights(radius, sigma);
+	float* padded = (float*)calloc(padded_size * 4, sizeof(float));
+	for (int i = 0; i < dim; i++) {
+		size_t y = (i - radius + padded_height) % padded_height;
+		for (int j = 0; j < dim; j++) {
+			size_t x = (j - radius + padded_width) % padded_width;
+			padded[(y * padded_width + x) * 4] = weights[i] * weights[j];
+		}
+	}
+	free(weights);
+
+	err = clEnqueueWriteBuffer(queue, fft_data[0], CL_TRUE, 0,
+		sizeof(cl_float4) * padded_size, padded, 0, NULL, NULL);
+	free(padded);
+	if (err < 0) {
+		perror("Couldn't write the buffer");
+		exit(1);
+	}
+
+	int current = fft_transform(0, -1.0f, events, &num_events);
+	err = clEnqueueCopyBuffer(queue, fft_data[current], fft_spectrum, 0, 0,
+		sizeof(cl_float4) * padded_size, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't copy the buffer");
+		exit(1);
+	}
+	clFinish(queue);
+	for (int i = 0; i < num_events; i++)
+		clReleaseEvent(events[i]);
+
+	fft_radius = radius;
+	fft_sigma = sigma;
+}
+
+/*
+ * Convolve in the frequency domain: forward transform the padded frame,
+ * multiply by the filter spectrum and transform back. The cost depends on
+ * the padded size, not the number of taps. Returns the summed kernel time in
+ * nanoseconds, not counting the filter transform which is cached.
+ */
+double BlurSession::blur_fft(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	size_t padded_size[2], frame_size[2] = { width, height }, points;
+	cl_int padded_width;
+	float scale;
+	cl_event events[128];
+	int num_events = 0;
+	cl_int err;
+	double time = 0;
+
+	fft_prepare(radius, sigma);
+	padded_size[0] = fft_width;
+	padded_size[1] = fft_height;
+	points = fft_width * fft_height;
+	padded_width = (cl_int)fft_width;
+	scale = 1.0f / points;
+
+	upload(input);
+
+	err = clSetKernelArg(fft_load_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(fft_load_kernel, 1, sizeof(cl_mem), &fft_data[0]);
+	err |= clSetKernelArg(fft_load_kernel, 2, sizeof(cl_int), &padded_width);
+	err |= clSetKernelArg(fft_load_kernel, 3, sizeof(cl_int), &radius);
+	err |= clEnqueueNDRangeKernel(queue, fft_load_kernel, 2, NULL, padded_size,
+		NULL, 0, NULL, &events[num_events++]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	int current = fft_transform(0, -1.0f, events, &num_events);
+
+	err = clSetKernelArg(fft_multiply_kernel, 0, sizeof(cl_mem), &fft_data[current]);
+	err |= clSetKernelArg(fft_multiply_kernel, 1, sizeof(cl_mem), &fft_spectrum);
+	err |= clSetKernelArg(fft_multiply_kernel, 2, sizeof(float), &scale);
+	err |= clEnqueueNDRangeKernel(queue, fft_multiply_kernel, 1, NULL, &points,
+		NULL, 0, NULL, &events[num_events++]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	current = fft_transform(current, 1.0f, events, &num_events);
+
+	err = clSetKernelArg(fft_store_kernel, 0, sizeof(cl_mem), &fft_data[current]);
+	err |= clSetKernelArg(fft_store_kernel, 1, sizeof(cl_mem), &output_image);
+	err |= clSetKernelArg(fft_store_kernel, 2, sizeof(cl_int), &padded_width);
+	err |= clSetKernelArg(fft_store_kernel, 3, sizeof(cl_int), &radius);
+	err |= clEnqueueNDRangeKernel(queue, fft_store_kernel, 2, NULL, frame_size,
+		NULL, 0, NULL, &events[num_events++]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	download(output_image, output);
+
+	clWaitForEvents(num_events, events);
+	for (int i = 0; i < num_events; i++) {
+		time += event_time(events[i]);
+		clReleaseEvent(events[i]);
+	}
+
+	return time;
+}
+
+/* Create an image array of layers frames of the session size */
+cl_mem create_image_array(cl_context ctx, cl_mem_flags flags, const cl_image_format* format,
+	size_t width, size_t height, size_t layers, cl_int* err) {
+	cl_image_desc desc;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D_ARRAY;
+	desc.image_width = width;
+	desc.image_height = height;
+	desc.image_array_size = layers;
+
+	return clCreateImage(ctx, flags, format, &desc, NULL, err);
+}
+
+/*
+ * Separable blur of count frames packed back to back in inputs, each the
+ * session size, with one launch per pass for as many frames as the device
+ * allows in an image array. Results are packed the same way in outputs.
+ * Returns the summed kernel time in nanoseconds.
+ */
+double BlurSession::blur_batch(const unsigned char* inputs, unsigned char* outputs, int count, int radius, float sigma) {
+	size_t frame_bytes = width * height * (greyscale ? 1 : 4);
+	size_t max_layers;
+	cl_int dim = 2 * radius + 1;
+	cl_event evnt_a, evnt_b;
+	cl_int err;
+	double time = 0;
+
+	clGetDeviceInfo(device, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE,
+		sizeof(max_layers), &max_layers, NULL);
+	if (max_layers > (size_t)count)
+		max_layers = count;
+
+	if (batch_layers < max_layers) {
+		if (batch_input != NULL) {
+			clReleaseMemObject(batch_input);
+			clReleaseMemObject(batch_vertical);
+			clReleaseMemObject(batch_output);
+		}
+		batch_input = create_image_array(context, CL_MEM_READ_ONLY, &img_format, width, height, max_layers, &err);
+		batch_vertical = create_image_array(context, CL_MEM_READ_WRITE, &intermediate_format, width, height, max_layers, &err);
+		batch_output = create_image_array(context, CL_MEM_WRITE_ONLY, &img_format, width, height, max_layers, &err);
+		if (err < 0) {
+			perror("Couldn't create the image object");
+			exit(1);
+		};
+		batch_layers = max_layers;
+	}
+
+	set_filter(radius, sigma);
+	cl_kernel first = variant(KERNEL_ARRAY_VERTICAL, vertical_array_kernel, radius, batch_input, batch_vertical);
+	cl_kernel second = variant(KERNEL_ARRAY_HORIZONTAL, horizontal_array_kernel, radius, batch_vertical, batch_output);
+
+	/* The arrays may have been recreated since the variant was built */
+	err = clSetKernelArg(first, 0, sizeof(cl_mem), &batch_input);
+	err |= clSetKernelArg(first, 1, sizeof(cl_mem), &batch_vertical);
+	err |= clSetKernelArg(first, 2, sizeof(cl_int), &dim);
+	err |= clSetKernelArg(first, 3, sizeof(cl_mem), &filter_1d);
+	err |= clSetKernelArg(second, 0, sizeof(cl_mem), &batch_vertical);
+	err |= clSetKernelArg(second, 1, sizeof(cl_mem), &batch_output);
+	err |= clSetKernelArg(second, 2, sizeof(cl_int), &dim);
+	err |= clSetKernelArg(second, 3, sizeof(cl_mem), &filter_1d);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	for (size_t first_frame = 0; first_frame < (size_t)count; first_frame += max_layers) {
+		size_t layers = count - first_frame < max_layers ? count - first_frame : max_layers;
+		size_t origin[3] = { 0, 0, 0 };
+		size_t region[3] = { width, height, layers };
+		size_t global_size[3] = { width, height, layers };
+
+		err = clEnqueueWriteImage(queue, batch_input, CL_FALSE, origin, region, 0, 0,
+			inputs + first_frame * frame_bytes, 0, NULL, NULL);
+		err |= clEnqueueNDRangeKernel(queue, first, 3, NULL, global_size,
+			NULL, 0, NULL, &evnt_a);
+		err |= clEnqueueNDRangeKernel(queue, second, 3, NULL, global_size,
+			NULL, 1, &evnt_a, &evnt_b);
+		if (err < 0) {
+			perror("Couldn't enqueue the kernel");
+			exit(1);
+		}
+		err = clEnqueueReadImage(queue, batch_output, CL_TRUE, origin, region, 0, 0,
+			outputs + first_frame * frame_bytes, 0, NULL, NULL);
+		if (err < 0) {
+			perror("Couldn't read from the image object");
+			exit(1);
+		}
+
+		time += event_time(evnt_a) + event_time(evnt_b);
+		clReleaseEvent(evnt_a);
+		clReleaseEvent(evnt_b);
+	}
+
+	return time;
+}
+
+/*
+ * Run a 2D kernel of the buffer backend with the given weights, returns the
+ * kernel time in nanoseconds. Arguments are (src, dst, dim, filter, width,
+ * height).
+ */
+double BlurSession::buffer_one_pass(cl_kernel kernel, const unsigned char* input, unsigned char* output,
+	int radius, cl_mem filter) {
+	size_t global_size[2] = { width, height };
+	cl_int dim = 2 * radius + 1, w = (cl_int)width, h = (cl_int)height;
+	cl_event evnt;
+	cl_int err;
+	double time;
+
+	if (filter == NULL) {
+		printf("Radius %d is too large for the naive kernel\n", radius);
+		exit(1);
+	}
+
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input_buffer);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &naive_result);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &dim);
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &h);
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueWriteBuffer(queue, input_buffer, CL_FALSE, 0,
+		4 * width * height, input, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size,
+		NULL, 0, NULL, &evnt);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+	err = clEnqueueReadBuffer(queue, naive_result, CL_TRUE, 0,
+		4 * width * height, output, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read the buffer");
+		exit(1);
+	}
+
+	clWaitForEvents(1, &evnt);
+	time = event_time(evnt);
+	clReleaseEvent(evnt);
 
-	/* Host/device data structures */
-	cl_device_id device;
-	cl_context context;
-	cl_command_queue queue;
-	cl_program program;
-	cl_kernel kernel1, kernel2a, kernel2b;
+	return time;
+}
+
+/*
+ * Run a vertical then horizontal pass of the buffer backend through the
+ * vertical_result buffer, returns the summed kernel time in nanoseconds.
+ */
+double BlurSession::buffer_two_pass(cl_kernel first, cl_kernel second, const unsigned char* input,
+	unsigned char* output, int radius, cl_mem filter) {
+	size_t global_size[2] = { width, height };
+	cl_int dim = 2 * radius + 1, w = (cl_int)width, h = (cl_int)height;
+	cl_event evnt_a, evnt_b;
 	cl_int err;
-	size_t global_size[2];
-	cl_event evnt1, evnt2a, evnt2b;
+	double time;
+
+	err = clSetKernelArg(first, 0, sizeof(cl_mem), &input_buffer);
+	err |= clSetKernelArg(first, 1, sizeof(cl_mem), &vertical_result);
+	err |= clSetKernelArg(second, 0, sizeof(cl_mem), &vertical_result);
+	err |= clSetKernelArg(second, 1, sizeof(cl_mem), &output_result);
+	for (int i = 0; i < 2; i++) {
+		cl_kernel kernel = i == 0 ? first : second;
+		err |= clSetKernelArg(kernel, 2, sizeof(cl_int), &dim);
+		err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &filter);
+		err |= clSetKernelArg(kernel, 4, sizeof(cl_int), &w);
+		err |= clSetKernelArg(kernel, 5, sizeof(cl_int), &h);
+	}
+	if (err < 0) {
+		printf("Couldn't set a kernel argument");
+		exit(1);
+	};
 
-	/* Image data */
-	unsigned char* inputImage;
-	unsigned char* outputinput;
-	unsigned char* outputImage1;
-	unsigned char* outputImage2;
+	err = clEnqueueWriteBuffer(queue, input_buffer, CL_FALSE, 0,
+		4 * width * height, input, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(queue, first, 2, NULL, global_size,
+		NULL, 0, NULL, &evnt_a);
+	err |= clEnqueueNDRangeKernel(queue, second, 2, NULL, global_size,
+		NULL, 1, &evnt_a, &evnt_b);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+	err = clEnqueueReadBuffer(queue, output_result, CL_TRUE, 0,
+		4 * width * height, output, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read the buffer");
+		exit(1);
+	}
 
-	cl_image_format img_format;
-	cl_mem input_image, output_image1, output_input, output_image2, buffer_dim;
-	size_t origin[3], region[3];
-	size_t width, height;
-	int w, h;
-	int dimension;
+	clWaitForEvents(1, &evnt_a);
+	clWaitForEvents(1, &evnt_b);
+	time = event_time(evnt_a) + event_time(evnt_b);
+	clReleaseEvent(evnt_a);
+	clReleaseEvent(evnt_b);
 
-	std::cout << "Please enter 3, 5 or 7: ";
-	std::cin >> dimension;
-	std::cin.ignore(100, '\n');
+	return time;
+}
 
-	//If you won't play by the rules, you can't play
-	if (dimension != 3 && dimension != 5 && dimension != 7) {
-		dimension = 3;
-	}
+/* 2D blur on the buffer backend, the counterpart of naive() */
+double BlurSession::naive_buffer(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return buffer_one_pass(variant(KERNEL_BUF_NAIVE, naive_buffer_kernel, radius, input_buffer, naive_result),
+		input, output, radius, filter_2d);
+}
 
-	/* Open input file and read image data */
-	inputImage = readRGBImage(INPUT_FILE, &w, &h);
-	width = w;
-	height = h;
-	/*outputImage1 = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-	outputinput = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-	outputImage2 = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);*/
+/* Separable blur on the buffer backend, the counterpart of blur() */
+double BlurSession::blur_buffer(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return buffer_two_pass(variant(KERNEL_BUF_VERTICAL, vertical_buffer_kernel, radius, input_buffer, vertical_result),
+		variant(KERNEL_BUF_HORIZONTAL, horizontal_buffer_kernel, radius, vertical_result, output_result),
+		input, output, radius, filter_1d);
+}
 
-	/* Create a device and context */
-	device = create_device();
+/* 2D blur with fixed-point weights and integer accumulation on the buffer backend */
+double BlurSession::naive_fixed(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return buffer_one_pass(variant(KERNEL_FIXED_NAIVE, naive_fixed_kernel, radius, input_buffer, naive_result),
+		input, output, radius, filter_fixed_2d);
+}
 
-	print_device(device);
+/* Separable blur with fixed-point weights through an 8-bit intermediate buffer */
+double BlurSession::blur_fixed(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	set_filter(radius, sigma);
+	return buffer_two_pass(variant(KERNEL_FIXED_VERTICAL, vertical_fixed_kernel, radius, input_buffer, vertical_result),
+		variant(KERNEL_FIXED_HORIZONTAL, horizontal_fixed_kernel, radius, vertical_result, output_result),
+		input, output, radius, filter_fixed_1d);
+}
 
-	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-	if (err < 0) {
-		perror("Couldn't create a context");
-		getchar();
-		exit(1);
+/*
+ * Decompose a dim x dim kernel and upload the weights for the path convolve()
+ * will take, only when the kernel changes. conv_rank is left as the number of
+ * separable terms used, or 0 when the kernel runs as a single 2D pass.
+ */
+void BlurSession::set_convolution(const float* kernel, int dim) {
+	float* columns = (float*)malloc(sizeof(float) * dim * MAX_SEPARABLE_RANK);
+	float* rows = (float*)malloc(sizeof(float) * dim * MAX_SEPARABLE_RANK);
+	cl_int err = 0;
+
+	if (conv_kernel != NULL && dim == conv_dim &&
+		memcmp(kernel, conv_kernel, sizeof(float) * dim * dim) == 0) {
+		free(columns);
+		free(rows);
+		return;
 	}
 
-	/* Build the program and create a kernel */
-	program = build_program(context, device, PROGRAM_FILE);
-	kernel1 = clCreateKernel(program, KERNEL_FUNC_1, &err);
-	kernel2a = clCreateKernel(program, KERNEL_FUNC_2a, &err);
-	kernel2b = clCreateKernel(program, KERNEL_FUNC_2b, &err);
+	if (conv_2d != NULL)
+		clReleaseMemObject(conv_2d);
+	conv_2d = NULL;
+	for (int i = 0; i < MAX_SEPARABLE_RANK; i++) {
+		if (conv_columns[i] != NULL) {
+			clReleaseMemObject(conv_columns[i]);
+			clReleaseMemObject(conv_rows[i]);
+		}
+		conv_columns[i] = NULL;
+		conv_rows[i] = NULL;
+	}
+
+	/* Separable passes read 2 * rank * dim taps a pixel against dim * dim for one 2D pass.
+	   A null kernel has rank 0 and is uploaded as it is for the 2D pass */
+	int rank = separable_decompose(kernel, dim, columns, rows);
+	if (rank >= 1 && rank <= MAX_SEPARABLE_RANK && 2 * rank * dim < dim * dim) {
+		for (int i = 0; i < rank; i++) {
+			conv_columns[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(float) * dim, &columns[i * dim], &err);
+			conv_rows[i] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+				sizeof(float) * dim, &rows[i * dim], &err);
+		}
+		conv_rank = rank;
+	}
+	else {
+		if (sizeof(float) * dim * dim > constant_size) {
+			printf("A %dx%d kernel of rank %d is too large for constant memory\n", dim, dim, rank);
+			exit(1);
+		}
+		conv_2d = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * dim * dim, (void*)kernel, &err);
+		conv_rank = 0;
+	}
+	free(columns);
+	free(rows);
 	if (err < 0) {
-		printf("Couldn't create a kernel: %d", err);
-		getchar();
+		perror("Couldn't create a buffer");
 		exit(1);
 	};
 
-	/* Create image object */
-	img_format.image_channel_order = CL_RGBA;
-	img_format.image_channel_data_type = CL_UNORM_INT8;
-	double sum1 = 0, sum2 = 0;
-	
-	for (int i = 0; i < NUM_ROUNDS; i++)
-	{
-		outputImage1 = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-		outputinput = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-		outputImage2 = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-
-		input_image = clCreateImage2D(context,
-			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			&img_format, width, height, 0, (void*)inputImage, &err);
-		output_image1 = clCreateImage2D(context,
-			CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
-		output_input = clCreateImage2D(context,
-			CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
-		output_image2 = clCreateImage2D(context,
-			CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
+	/* Float intermediates so negative weights survive between passes */
+	if (conv_rank > 0 && conv_image == NULL) {
+		cl_image_format float_format;
+		float_format.image_channel_order = CL_RGBA;
+		float_format.image_channel_data_type = CL_FLOAT;
+		conv_image = clCreateImage2D(context, CL_MEM_READ_WRITE,
+			&float_format, width, height, 0, NULL, &err);
+		conv_accumulator = clCreateBuffer(context, CL_MEM_READ_WRITE,
+			sizeof(cl_float4) * width * height, NULL, &err);
 		if (err < 0) {
 			perror("Couldn't create the image object");
 			exit(1);
 		};
+	}
+
+	free(conv_kernel);
+	conv_kernel = (float*)malloc(sizeof(float) * dim * dim);
+	memcpy(conv_kernel, kernel, sizeof(float) * dim * dim);
+	conv_dim = dim;
+}
+
+/*
+ * Convolve with an arbitrary odd dim x dim row-major kernel. Kernels that are
+ * a sum of a few separable terms run as a column and row pass per term,
+ * anything else as one 2D pass. rank, if given, receives the number of terms
+ * used or 0 for the 2D pass. Returns the summed kernel time in nanoseconds.
+ */
+double BlurSession::convolve(const unsigned char* input, unsigned char* output, const float* kernel, int dim,
+	int* rank) {
+	size_t global_size[2] = { width, height };
+	cl_event events[2 * MAX_SEPARABLE_RANK + 1];
+	int num_events = 0;
+	cl_int err;
+	double time = 0;
+
+	set_convolution(kernel, dim);
+	if (rank != NULL)
+		*rank = conv_rank;
 
-		/* Create kernel arguments */
-		err = clSetKernelArg(kernel1, 0, sizeof(cl_mem), &input_image);
-		err |= clSetKernelArg(kernel1, 1, sizeof(cl_mem), &output_image1);
-		err |= clSetKernelArg(kernel1, 2, sizeof(cl_int), &dimension);
-		err |= clSetKernelArg(kernel2a, 0, sizeof(cl_mem), &input_image);
-		err |= clSetKernelArg(kernel2a, 1, sizeof(cl_mem), &output_input);
-		err |= clSetKernelArg(kernel2a, 2, sizeof(cl_int), &dimension);
-		err |= clSetKernelArg(kernel2b, 1, sizeof(cl_mem), &output_image2);
-		err |= clSetKernelArg(kernel2b, 2, sizeof(cl_int), &dimension);
+	if (conv_rank == 0) {
+		err = clSetKernelArg(naive_kernel, 2, sizeof(cl_int), &dim);
+		err |= clSetKernelArg(naive_kernel, 3, sizeof(cl_mem), &conv_2d);
 		if (err < 0) {
 			printf("Couldn't set a kernel argument");
-			getchar();
 			exit(1);
 		};
-
-		/* Create a command queue */
-		queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+		upload(input);
+		err = clEnqueueNDRangeKernel(queue, naive_kernel, 2, NULL, global_size,
+			NULL, 0, NULL, &events[num_events++]);
+		if (err < 0) {
+			perror("Couldn't enqueue the kernel");
+			exit(1);
+		}
+		download(naive_image, output);
+	}
+	else if (conv_rank == 1) {
+		/* A single term maps straight onto the two pass blur */
+		err = clSetKernelArg(vertical_kernel, 1, sizeof(cl_mem), &conv_image);
+		err |= clSetKernelArg(horizontal_kernel, 0, sizeof(cl_mem), &conv_image);
+		err |= clSetKernelArg(vertical_kernel, 3, sizeof(cl_mem), &conv_columns[0]);
+		err |= clSetKernelArg(horizontal_kernel, 3, sizeof(cl_mem), &conv_rows[0]);
+		err |= clSetKernelArg(vertical_kernel, 2, sizeof(cl_int), &dim);
+		err |= clSetKernelArg(horizontal_kernel, 2, sizeof(cl_int), &dim);
 		if (err < 0) {
-			perror("Couldn't create a command queue");
-			getchar();
+			printf("Couldn't set a kernel argument");
 			exit(1);
 		};
-
-		/* Enqueue kernel */
-		global_size[0] = width; global_size[1] = height;
-		err = clEnqueueNDRangeKernel(queue, kernel1, 2, NULL, global_size,
-			NULL, 0, NULL, &evnt1);
-		err = clEnqueueNDRangeKernel(queue, kernel2a, 2, NULL, global_size,
-			NULL, 0, NULL, &evnt2a);
+		upload(input);
+		err = clEnqueueNDRangeKernel(queue, vertical_kernel, 2, NULL, global_size,
+			NULL, 0, NULL, &events[num_events++]);
+		err |= clEnqueueNDRangeKernel(queue, horizontal_kernel, 2, NULL, global_size,
+			NULL, 0, NULL, &events[num_events++]);
 		if (err < 0) {
 			perror("Couldn't enqueue the kernel");
-			getchar();
 			exit(1);
 		}
+		download(output_image, output);
 
-		/* Read the image object */
-		origin[0] = 0; origin[1] = 0; origin[2] = 0;
-		region[0] = width; region[1] = height; region[2] = 1;
-		err = clEnqueueReadImage(queue, output_image1, CL_TRUE, origin,
-			region, 0, 0, (void*)outputImage1, 0, NULL, NULL);
+		/* Restore the blur bindings */
+		err = clSetKernelArg(vertical_kernel, 1, sizeof(cl_mem), &vertical_image);
+		err |= clSetKernelArg(horizontal_kernel, 0, sizeof(cl_mem), &vertical_image);
 		if (err < 0) {
-			perror("Couldn't read from the image object");
+			printf("Couldn't set a kernel argument");
+			exit(1);
+		};
+	}
+	else {
+		/* Each term adds its row pass into the accumulator */
+		err = clSetKernelArg(vertical_kernel, 1, sizeof(cl_mem), &conv_image);
+		err |= clSetKernelArg(vertical_kernel, 2, sizeof(cl_int), &dim);
+		err |= clSetKernelArg(conv_rows_kernel, 0, sizeof(cl_mem), &conv_image);
+		err |= clSetKernelArg(conv_rows_kernel, 1, sizeof(cl_mem), &conv_accumulator);
+		err |= clSetKernelArg(conv_rows_kernel, 2, sizeof(cl_int), &dim);
+		err |= clSetKernelArg(conv_store_kernel, 0, sizeof(cl_mem), &conv_accumulator);
+		err |= clSetKernelArg(conv_store_kernel, 1, sizeof(cl_mem), &output_image);
+		if (err < 0) {
+			printf("Couldn't set a kernel argument");
 			exit(1);
+		};
+		upload(input);
+		for (cl_int i = 0; i < conv_rank; i++) {
+			err = clSetKernelArg(vertical_kernel, 3, sizeof(cl_mem), &conv_columns[i]);
+			err |= clSetKernelArg(conv_rows_kernel, 3, sizeof(cl_mem), &conv_rows[i]);
+			err |= clSetKernelArg(conv_rows_kernel, 4, sizeof(cl_int), &i);
+			err |= clEnqueueNDRangeKernel(queue, vertical_kernel, 2, NULL, global_size,
+				NULL, 0, NULL, &events[num_events++]);
+			err |= clEnqueueNDRangeKernel(queue, conv_rows_kernel, 2, NULL, global_size,
+				NULL, 0, NULL, &events[num_events++]);
+			if (err < 0) {
+				perror("Couldn't enqueue the kernel");
+				exit(1);
+			}
 		}
-
-		origin[0] = 0; origin[1] = 0; origin[2] = 0;
-		region[0] = width; region[1] = height; region[2] = 1;
-		err = clEnqueueReadImage(queue, output_input, CL_TRUE, origin,
-			region, 0, 0, (void*)outputinput, 0, NULL, NULL);
+		err = clEnqueueNDRangeKernel(queue, conv_store_kernel, 2, NULL, global_size,
+			NULL, 0, NULL, &events[num_events++]);
 		if (err < 0) {
-			perror("Couldn't read from the image object");
+			perror("Couldn't enqueue the kernel");
 			exit(1);
 		}
+		download(output_image, output);
 
-		output_input = clCreateImage2D(context,
-			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			&img_format, width, height, 0, (void*)outputinput, &err);
-
-		err = clSetKernelArg(kernel2b, 0, sizeof(cl_mem), &output_input);
+		err = clSetKernelArg(vertical_kernel, 1, sizeof(cl_mem), &vertical_image);
 		if (err < 0) {
 			printf("Couldn't set a kernel argument");
 			exit(1);
 		};
+	}
 
-		err = clEnqueueNDRangeKernel(queue, kernel2b, 2, NULL, global_size,
-			NULL, 0, NULL, &evnt2b);
-		if (err < 0) {
-			perror("Couldn't enqueue the kernel");
-			exit(1);
+	clWaitForEvents(num_events, events);
+	for (int i = 0; i < num_events; i++) {
+		time += event_time(events[i]);
+		clReleaseEvent(events[i]);
+	}
+
+	return time;
+}
+
+/* A blur method of BlurSession, timed by the benchmark loop */
+typedef double (BlurSession::*BlurMethod)(const unsigned char*, unsigned char*, int, float);
+
+/* How a mode's work per pixel grows with the filter width. COST_FFT work
+   follows the padded transform size, which jumps at powers of two */
+enum CostGrowth { COST_CONSTANT, COST_LINEAR, COST_QUADRATIC, COST_FFT };
+
+/* exact is false for modes that only approximate the Gaussian, the automatic
+   mode skips them. needs_rgba modes work on uchar4 buffers and cannot run
+   on greyscale frames */
+struct BlurMode {
+	const char* name;
+	BlurMethod run;
+	const char* output_file;
+	bool needs_2d_filter;
+	CostGrowth growth;
+	bool exact;
+	bool needs_rgba;
+};
+
+BlurMode blur_modes[] = {
+	{ "naive", &BlurSession::naive, OUTPUT_FILE_1, true, COST_QUADRATIC, true, false },
+	{ "two pass", &BlurSession::blur, OUTPUT_FILE_2, false, COST_LINEAR, true, false },
+	{ "tiled two pass", &BlurSession::blur_tiled, OUTPUT_FILE_3, false, COST_LINEAR, true, false },
+	{ "linear sampler", &BlurSession::blur_linear, OUTPUT_FILE_4, false, COST_LINEAR, true, false },
+	{ "blocked naive", &BlurSession::naive_blocked, OUTPUT_FILE_5, true, COST_QUADRATIC, true, false },
+	{ "blocked two pass", &BlurSession::blur_blocked, OUTPUT_FILE_6, false, COST_LINEAR, true, false },
+	{ "recursive", &BlurSession::blur_iir, OUTPUT_FILE_7, false, COST_CONSTANT, false, false },
+	{ "stacked box", &BlurSession::blur_box, OUTPUT_FILE_8, false, COST_CONSTANT, false, false },
+	{ "FFT", &BlurSession::blur_fft, OUTPUT_FILE_9, false, COST_FFT, true, false },
+	{ "naive buffer", &BlurSession::naive_buffer, OUTPUT_FILE_10, true, COST_QUADRATIC, true, true },
+	{ "two pass buffer", &BlurSession::blur_buffer, OUTPUT_FILE_11, false, COST_LINEAR, true, true },
+	{ "naive fixed", &BlurSession::naive_fixed, OUTPUT_FILE_12, true, COST_QUADRATIC, true, true },
+	{ "two pass fixed", &BlurSession::blur_fixed, OUTPUT_FILE_13, false, COST_LINEAR, true, true },
+};
+static const int NUM_MODES = (int)(sizeof(blur_modes) / sizeof(blur_modes[0]));
+
+/* Index of the mode running method in blur_modes */
+int find_mode(BlurMethod run) {
+	for (int m = 0; m < NUM_MODES; m++) {
+		if (blur_modes[m].run == run)
+			return m;
+	}
+	printf("No blur mode runs this method\n");
+	exit(1);
+}
+
+/* Modes compared by COMPARE_LINEAR and COMPARE_FIXED */
+const int MODE_NAIVE = find_mode(&BlurSession::naive);
+const int MODE_TWO_PASS = find_mode(&BlurSession::blur);
+const int MODE_LINEAR = find_mode(&BlurSession::blur_linear);
+const int MODE_NAIVE_FIXED = find_mode(&BlurSession::naive_fixed);
+const int MODE_TWO_PASS_FIXED = find_mode(&BlurSession::blur_fixed);
+
+/*
+ * Taps per pixel that a mode's cost scales with at radius on a width by
+ * height frame. For the FFT path it is the butterfly work of the padded
+ * transform, n log2 n over its padded pixels, shared out over the frame.
+ */
+double cost_taps(CostGrowth growth, int radius, size_t width, size_t height) {
+	double dim = 2 * radius + 1;
+
+	if (growth == COST_QUADRATIC)
+		return dim * dim;
+	if (growth == COST_LINEAR)
+		return dim;
+	if (growth == COST_FFT) {
+		double padded = (double)next_pow2(width + 2 * radius) * next_pow2(height + 2 * radius);
+		return padded * log2(padded) / ((double)width * height);
+	}
+	return 1;
+}
+
+/* One choice made by the automatic mode */
+struct AutoDecision {
+	int radius;
+	int mode;
+	double predicted, actual;
+};
+
+/*
+ * Per-device cost model for the exact blur modes. Each mode's time is
+ * fitted as overhead + (fixed + per_tap * taps) * pixels from probe runs at
+ * two radii and two frame sizes. The overhead is paid once per blur
+ * whatever the frame size, so modes with many launches lose on small
+ * frames and the choice depends on both the radius and the frame size.
+ */
+struct BlurPlanner {
+	BlurSession* session;
+	double overhead[NUM_MODES], fixed[NUM_MODES], per_tap[NUM_MODES];
+	bool usable[NUM_MODES];
+	AutoDecision decisions[MAX_DECISIONS];
+	int num_decisions;
+
+	BlurPlanner(BlurSession* s);
+
+	double probe(BlurSession* s, int mode, const unsigned char* input, unsigned char* output, int radius);
+	void calibrate(const unsigned char* input, unsigned char* output);
+	double predict(int mode, int radius, size_t width, size_t height);
+	int choose(int radius, size_t width, size_t height);
+	double blur_auto(const unsigned char* input, unsigned char* output, int radius, float sigma = 0);
+	void report();
+};
+
+BlurPlanner::BlurPlanner(BlurSession* s) {
+	session = s;
+	num_decisions = 0;
+	for (int m = 0; m < NUM_MODES; m++) {
+		overhead[m] = 0;
+		fixed[m] = 0;
+		per_tap[m] = 0;
+		usable[m] = false;
+	}
+}
+
+/* Average time of a mode at radius on the frames of s after one untimed warm-up run */
+double BlurPlanner::probe(BlurSession* s, int mode, const unsigned char* input, unsigned char* output, int radius) {
+	double time = 0;
+
+	(s->*blur_modes[mode].run)(input, output, radius, 0);
+	for (int i = 0; i < PROBE_ROUNDS; i++)
+		time += (s->*blur_modes[mode].run)(input, output, radius, 0);
+
+	return time / PROBE_ROUNDS;
+}
+
+/*
+ * Fit every exact mode on this device, modes the device cannot run are left
+ * unusable. The top left PROBE_SIDE square of input is blurred in a second,
+ * small session, frames no larger than it leave the overhead at 0.
+ */
+void BlurPlanner::calibrate(const unsigned char* input, unsigned char* output) {
+	size_t pixels = session->width * session->height;
+	size_t small_w = session->width < PROBE_SIDE ? session->width : PROBE_SIDE;
+	size_t small_h = session->height < PROBE_SIDE ? session->height : PROBE_SIDE;
+	size_t small_pixels = small_w * small_h;
+	BlurSession* small = NULL;
+	unsigned char* small_input = NULL;
+
+	if (small_pixels < pixels) {
+		small = new BlurSession(session->device, small_w, small_h, session->img_format);
+		small_input = (unsigned char*)malloc(small_pixels * CHANNELS);
+		for (size_t y = 0; y < small_h; y++)
+			memcpy(small_input + y * small_w * CHANNELS, input + y * session->width * CHANNELS,
+				small_w * CHANNELS);
+	}
+
+	for (int m = 0; m < NUM_MODES; m++) {
+		if (!blur_modes[m].exact || (blur_modes[m].needs_rgba && session->greyscale))
+			continue;
+		if (blur_modes[m].needs_2d_filter && !session->naive_supported(PROBE_RADIUS_HIGH))
+			continue;
+
+		/* Two frame sizes at the low radius give the overhead and the
+		   per-pixel time, the high radius then needs only the full frame.
+		   The work of each size is its pixels times its taps per pixel,
+		   which only differ between sizes for the FFT path */
+		CostGrowth growth = blur_modes[m].growth;
+		double taps_low = cost_taps(growth, PROBE_RADIUS_LOW, session->width, session->height);
+		double taps_high = cost_taps(growth, PROBE_RADIUS_HIGH, session->width, session->height);
+		double full = probe(session, m, input, output, PROBE_RADIUS_LOW);
+		overhead[m] = 0;
+		if (small != NULL) {
+			double part = probe(small, m, small_input, output, PROBE_RADIUS_LOW);
+			double work = taps_low * pixels;
+			double small_work = cost_taps(growth, PROBE_RADIUS_LOW, small_w, small_h) * small_pixels;
+			if (work > small_work) {
+				overhead[m] = full - (full - part) / (work - small_work) * work;
+				if (overhead[m] < 0)
+					overhead[m] = 0;
+			}
 		}
+		double low = (full - overhead[m]) / pixels;
+		double high = (probe(session, m, input, output, PROBE_RADIUS_HIGH) - overhead[m]) / pixels;
 
-		origin[0] = 0; origin[1] = 0; origin[2] = 0;
-		region[0] = width; region[1] = height; region[2] = 1;
-		err = clEnqueueReadImage(queue, output_image2, CL_TRUE, origin,
-			region, 0, 0, (void*)outputImage2, 0, NULL, NULL);
-		if (err < 0) {
-			perror("Couldn't read from the image object");
-			exit(1);
+		if (growth == COST_FFT) {
+			/* The transform work is all there is, the two radii only average it */
+			per_tap[m] = (low / taps_low + high / taps_high) / 2;
+			fixed[m] = 0;
+		}
+		else if (taps_high > taps_low) {
+			per_tap[m] = (high - low) / (taps_high - taps_low);
+			if (per_tap[m] < 0)
+				per_tap[m] = 0;
+			fixed[m] = low - per_tap[m] * taps_low;
+			if (fixed[m] < 0)
+				fixed[m] = 0;
+		}
+		else {
+			per_tap[m] = 0;
+			fixed[m] = (low + high) / 2;
+		}
+		usable[m] = true;
+	}
+
+	if (small != NULL) {
+		delete small;
+		free(small_input);
+	}
+}
+
+/* Predicted kernel time in nanoseconds of a mode for a width by height frame */
+double BlurPlanner::predict(int mode, int radius, size_t width, size_t height) {
+	double taps = cost_taps(blur_modes[mode].growth, radius, width, height);
+	return overhead[mode] + (fixed[mode] + per_tap[mode] * taps) * width * height;
+}
+
+/* Mode with the lowest predicted time at radius, -1 if none was calibrated */
+int BlurPlanner::choose(int radius, size_t width, size_t height) {
+	int best = -1;
+
+	for (int m = 0; m < NUM_MODES; m++) {
+		if (!usable[m])
+			continue;
+		if (blur_modes[m].needs_2d_filter && !session->naive_supported(radius))
+			continue;
+		if (best < 0 || predict(m, radius, width, height) < predict(best, radius, width, height))
+			best = m;
+	}
+
+	return best;
+}
+
+/* Blur with the mode the model predicts is fastest, recording the decision */
+double BlurPlanner::blur_auto(const unsigned char* input, unsigned char* output, int radius, float sigma) {
+	int mode = choose(radius, session->width, session->height);
+
+	if (mode < 0) {
+		printf("The automatic mode has not been calibrated\n");
+		exit(1);
+	}
+
+	double time = (session->*blur_modes[mode].run)(input, output, radius, sigma);
+
+	if (num_decisions < MAX_DECISIONS) {
+		decisions[num_decisions].radius = radius;
+		decisions[num_decisions].mode = mode;
+		decisions[num_decisions].predicted = predict(mode, radius, session->width, session->height);
+		decisions[num_decisions].actual = time;
+		num_decisions++;
+	}
+
+	return time;
+}
+
+/* Print the fitted model and every recorded decision */
+void BlurPlanner::report() {
+	std::cout << "\nCost model, microseconds per blur plus nanoseconds per pixel:" << std::endl;
+	for (int m = 0; m < NUM_MODES; m++) {
+		if (usable[m])
+			printf("\t%-18s %8.1f + (%8.4f + %8.5f per tap) per pixel\n", blur_modes[m].name,
+				overhead[m] / 1000.0, fixed[m], per_tap[m]);
+	}
+
+	std::cout << "\nAutomatic mode decisions:" << std::endl;
+	printf("\t%8s %-18s %14s %14s\n", "radius", "mode", "predicted ms", "actual ms");
+	for (int i = 0; i < num_decisions; i++) {
+		printf("\t%8d %-18s %14.3f %14.3f\n", decisions[i].radius, blur_modes[decisions[i].mode].name,
+			decisions[i].predicted / 1000000.0, decisions[i].actual / 1000000.0);
+	}
+}
+
+/*
+ * Time the two pass and FFT paths at doubling radii on this device and
+ * report the first radius where the FFT path is faster.
+ */
+void fft_crossover(BlurSession* session, const unsigned char* input, unsigned char* output) {
+	int crossover = 0;
+
+	std::cout << "\nFFT crossover, average of " << CROSSOVER_ROUNDS << " rounds:" << std::endl;
+	printf("\t%8s %12s %12s\n", "radius", "two pass ms", "FFT ms");
+
+	for (int radius = 1; radius <= CROSSOVER_MAX_RADIUS; radius *= 2) {
+		double separable = 0, fft = 0;
+
+		for (int i = 0; i < CROSSOVER_ROUNDS; i++) {
+			separable += session->blur(input, output, radius);
+			fft += session->blur_fft(input, output, radius);
+		}
+		separable /= CROSSOVER_ROUNDS * 1000000.0;
+		fft /= CROSSOVER_ROUNDS * 1000000.0;
+		printf("\t%8d %12.3f %12.3f\n", radius, separable, fft);
+
+		if (crossover == 0 && fft < separable)
+			crossover = radius;
+	}
+
+	if (crossover > 0)
+		printf("\tFFT overtakes two pass from radius %d\n", crossover);
+	else
+		printf("\tTwo pass stays faster up to radius %d\n", CROSSOVER_MAX_RADIUS);
+}
+
+/* Write a frame as a BMP in the format selected by GREYSCALE */
+void store_frame(unsigned char* pixels, const char* filename, int h, int w) {
+#if GREYSCALE
+	storeGreyscaleImage(pixels, filename, h, w, GREY_INPUT_FILE);
+#else
+	storeRGBImage(pixels, filename, h, w, INPUT_FILE);
+#endif
+}
+
+/* Example filters for convolve(), row-major 3x3 */
+const float sharpen_filter[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+const float sobel_filter[9] = { -1, 0, 1, -2, 0, 2, -1, 0, 1 };
+const float emboss_filter[9] = { -2, -1, 0, -1, 1, 1, 0, 1, 2 };
+
+/*
+ * Run the example filters and a 2D Gaussian matrix through convolve(),
+ * reporting the path each one took and writing the results.
+ */
+void run_convolutions(BlurSession* session, const unsigned char* input, unsigned char* output,
+	int w, int h, float sigma) {
+	float* gaussian = gaussian_weights_2d(3, sigma);
+	const char* names[4] = { "sharpen", "sobel", "emboss", "gaussian" };
+	const float* filters[4] = { sharpen_filter, sobel_filter, emboss_filter, gaussian };
+	int dims[4] = { 3, 3, 3, 7 };
+	char filename[64];
+
+	std::cout << "\nGeneral convolution:" << std::endl;
+	for (int i = 0; i < 4; i++) {
+		int rank;
+		double time = session->convolve(input, output, filters[i], dims[i], &rank);
+
+		if (rank == 0)
+			printf("\t%-10s %dx%d as one 2D pass: %0.3f milliseconds\n", names[i], dims[i], dims[i], time / 1000000.0);
+		else
+			printf("\t%-10s %dx%d as %d separable term(s): %0.3f milliseconds\n", names[i], dims[i], dims[i], rank, time / 1000000.0);
+
+		sprintf(filename, OUTPUT_FILE_CONV, names[i]);
+		store_frame(output, filename, h, w);
+	}
+
+	free(gaussian);
+}
+
+/*
+ * Columns per tile so that a tile and its radius halo left and right fit
+ * the image width limit. Returns width when the whole frame fits.
+ */
+size_t strip_columns(cl_device_id dev, size_t width, int radius) {
+	size_t max_width;
+
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(max_width), &max_width, NULL);
+	if (width <= max_width)
+		return width;
+	if (max_width <= 2 * (size_t)radius) {
+		printf("The image width limit is too small for a radius %d halo\n", radius);
+		exit(1);
+	}
+	return max_width - 2 * radius;
+}
+
+/*
+ * Rows per strip so that a strip of width pixels, halo included, and its
+ * radius halo above and below take no more than bytes_per_pixel per pixel
+ * out of 1/STRIP_MEMORY_FRACTION of the global memory, and fit a single
+ * allocation and the image height limit. Returns height when the whole
+ * frame fits.
+ */
+size_t strip_rows(cl_device_id dev, size_t width, size_t height, int radius, size_t bytes_per_pixel) {
+	cl_ulong global_mem, max_alloc;
+	size_t max_height, rows;
+
+	clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(max_height), &max_height, NULL);
+
+	rows = (size_t)(global_mem / STRIP_MEMORY_FRACTION / (bytes_per_pixel * width));
+	if (rows > max_alloc / (sizeof(cl_float4) * width))
+		rows = (size_t)(max_alloc / (sizeof(cl_float4) * width));
+	if (rows >= height && height <= max_height)
+		return height;
+	if (rows > max_height)
+		rows = max_height;
+	if (rows <= 2 * (size_t)radius) {
+		printf("Not enough device memory for a strip with a radius %d halo\n", radius);
+		exit(1);
+	}
+	return rows - 2 * radius;
+}
+
+/*
+ * Copy strip_height rows starting radius rows above first from a frame of
+ * height rows into strip, rows past the frame edges repeating the edge row
+ * the way clamp to edge does on the whole frame.
+ */
+void gather_strip(const unsigned char* input, unsigned char* strip, size_t row_bytes,
+	size_t height, size_t first, size_t strip_height, int radius) {
+	for (size_t i = 0; i < strip_height; i++) {
+		long long y = (long long)(first + i) - radius;
+		if (y < 0)
+			y = 0;
+		if (y > (long long)height - 1)
+			y = height - 1;
+		memcpy(strip + i * row_bytes, input + (size_t)y * row_bytes, row_bytes);
+	}
+}
+
+/* Coordinate v clamped to a frame side of size pixels */
+size_t clamp_coordinate(long long v, size_t size) {
+	if (v < 0)
+		return 0;
+	if (v > (long long)size - 1)
+		return size - 1;
+	return (size_t)v;
+}
+
+/*
+ * Copy a tile_width by tile_height tile starting x_halo columns left of x0
+ * and y_halo rows above y0 from a width by height frame into tile, pixels
+ * past the frame edges repeating the edge pixel the way clamp to edge does
+ * on the whole frame.
+ */
+void gather_tile(const unsigned char* input, unsigned char* tile, size_t width, size_t height,
+	size_t x0, size_t y0, size_t tile_width, size_t tile_height, int x_halo, int y_halo) {
+	for (size_t i = 0; i < tile_height; i++) {
+		const unsigned char* row = input +
+			clamp_coordinate((long long)(y0 + i) - y_halo, height) * width * CHANNELS;
+		unsigned char* dst = tile + i * tile_width * CHANNELS;
+
+		for (size_t j = 0; j < tile_width;) {
+			long long x = (long long)(x0 + j) - x_halo;
+			if (x < 0 || x >= (long long)width) {
+				memcpy(dst + j * CHANNELS, row + clamp_coordinate(x, width) * CHANNELS, CHANNELS);
+				j++;
+			}
+			else {
+				/* Copy the run inside the frame in one go */
+				size_t run = width - (size_t)x < tile_width - j ? width - (size_t)x : tile_width - j;
+				memcpy(dst + j * CHANNELS, row + (size_t)x * CHANNELS, run * CHANNELS);
+				j += run;
+			}
+		}
+	}
+}
+
+/*
+ * Two pass blur of a width by height frame through a session made for tiles
+ * of columns by rows pixels. Tiles narrower or shorter than the frame carry
+ * a radius halo on those sides, so the session must be that much larger.
+ * Halo pixels past the frame edges repeat the edge pixel the way clamp to
+ * edge does on the whole frame, so the stitched output matches blur() on
+ * the whole frame. Returns the summed kernel time in nanoseconds.
+ */
+double blur_tiles(BlurSession* session, const unsigned char* input, unsigned char* output,
+	size_t width, size_t height, size_t columns, size_t rows, int radius, float sigma) {
+	int x_halo = columns < width ? radius : 0, y_halo = rows < height ? radius : 0;
+	size_t tile_bytes = session->width * session->height * CHANNELS;
+	unsigned char* tile_in = (unsigned char*)malloc(tile_bytes);
+	unsigned char* tile_out = (unsigned char*)malloc(tile_bytes);
+	double time = 0;
+
+	if (session->width != columns + 2 * x_halo || session->height != rows + 2 * y_halo) {
+		printf("The session does not fit tiles of %d by %d pixels\n", (int)columns, (int)rows);
+		exit(1);
+	}
+
+	for (size_t y0 = 0; y0 < height; y0 += rows) {
+		size_t count = height - y0 < rows ? height - y0 : rows;
+
+		for (size_t x0 = 0; x0 < width; x0 += columns) {
+			size_t span = width - x0 < columns ? width - x0 : columns;
+
+			gather_tile(input, tile_in, width, height, x0, y0, session->width, session->height,
+				x_halo, y_halo);
+			time += session->blur(tile_in, tile_out, radius, sigma);
+
+			/* Keep the pixels clear of the halo */
+			for (size_t i = 0; i < count; i++)
+				memcpy(output + ((y0 + i) * width + x0) * CHANNELS,
+					tile_out + ((y_halo + i) * session->width + x_halo) * CHANNELS, span * CHANNELS);
+		}
+	}
+
+	free(tile_in);
+	free(tile_out);
+	return time;
+}
+
+/* Every device with image support on every platform, up to max, returns how many */
+int all_devices(cl_device_id* devices, int max) {
+	cl_platform_id platforms[MAX_DEVICES];
+	cl_device_id found[MAX_DEVICES];
+	cl_uint platform_count, device_count;
+	cl_bool images;
+	int count = 0;
+
+	clGetPlatformIDs(MAX_DEVICES, platforms, &platform_count);
+	if (platform_count > MAX_DEVICES)
+		platform_count = MAX_DEVICES;
+	for (cl_uint i = 0; i < platform_count; i++) {
+		if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, MAX_DEVICES, found, &device_count) < 0)
+			continue;
+		if (device_count > MAX_DEVICES)
+			device_count = MAX_DEVICES;
+		for (cl_uint j = 0; j < device_count && count < max; j++) {
+			clGetDeviceInfo(found[j], CL_DEVICE_IMAGE_SUPPORT, sizeof(images), &images, NULL);
+			if (images)
+				devices[count++] = found[j];
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Blur a frame across several devices at once. The frame is split into
+ * horizontal bands sized by each device's two pass throughput on a probe
+ * band of the input, and every device gets its band plus radius halo rows
+ * from the bands either side, gathered as in blur_tiles(), so the seams
+ * match blur() on a single device up to rounding differences between the
+ * devices. Prints the split and returns the longest kernel time of any
+ * device in nanoseconds.
+ */
+double blur_multi_device(const cl_device_id* devices, int count, cl_image_format format,
+	const unsigned char* input, unsigned char* output, size_t width, size_t height,
+	int radius, float sigma) {
+	BlurSession* probes[MAX_DEVICES];
+	BlurSession* sessions[MAX_DEVICES];
+	unsigned char* band_in[MAX_DEVICES];
+	unsigned char* band_out[MAX_DEVICES];
+	size_t first[MAX_DEVICES], rows[MAX_DEVICES];
+	double rate[MAX_DEVICES], total_rate = 0, longest = 0;
+	size_t row_bytes = width * CHANNELS, next = 0;
+	size_t probe_height = (BAND_PROBE_ROWS < height ? BAND_PROBE_ROWS : height) + 2 * radius;
+	unsigned char* probe_in = (unsigned char*)malloc(row_bytes * probe_height);
+	unsigned char* probe_out = (unsigned char*)malloc(row_bytes * probe_height);
+	char name[48];
+
+	/* Pixels per nanosecond of each device after one untimed warm-up run. The
+	   program built for the probe, with its -D RADIUS variant, is shared with
+	   the band session */
+	gather_strip(input, probe_in, row_bytes, height, 0, probe_height, radius);
+	for (int i = 0; i < count; i++) {
+		double time = 0;
+
+		probes[i] = new BlurSession(devices[i], width, probe_height, format);
+		probes[i]->blur(probe_in, probe_out, radius, sigma);
+		for (int r = 0; r < PROBE_ROUNDS; r++)
+			time += probes[i]->blur(probe_in, probe_out, radius, sigma);
+		rate[i] = PROBE_ROUNDS * (double)width * probe_height / time;
+		total_rate += rate[i];
+	}
+	free(probe_in);
+	free(probe_out);
+
+	/* Bands proportional to throughput, the last one takes the rounding.
+	   Devices given no rows sit the frame out */
+	for (int i = 0; i < count; i++) {
+		rows[i] = i == count - 1 ? height - next : (size_t)(height * rate[i] / total_rate);
+		if (rows[i] > height - next)
+			rows[i] = height - next;
+		first[i] = next;
+		next += rows[i];
+		sessions[i] = NULL;
+		if (rows[i] == 0)
+			continue;
+		sessions[i] = new BlurSession(probes[i], width, rows[i] + 2 * radius);
+		sessions[i]->prepare_blur(radius, sigma);
+		band_in[i] = (unsigned char*)malloc(row_bytes * sessions[i]->height);
+		band_out[i] = (unsigned char*)malloc(row_bytes * sessions[i]->height);
+		gather_strip(input, band_in[i], row_bytes, height, first[i], sessions[i]->height, radius);
+	}
+
+	/* Start every band before waiting on any, nothing is left to compile */
+	for (int i = 0; i < count; i++) {
+		if (sessions[i] != NULL)
+			sessions[i]->start_blur(band_in[i], band_out[i], radius, sigma);
+	}
+	for (int i = 0; i < count; i++) {
+		if (sessions[i] == NULL)
+			continue;
+		double time = sessions[i]->finish_blur();
+		if (time > longest)
+			longest = time;
+		memcpy(output + first[i] * row_bytes, band_out[i] + radius * row_bytes, rows[i] * row_bytes);
+
+		clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+		printf("\tRows %d-%d on %s: %0.3f milliseconds\n", (int)first[i],
+			(int)(first[i] + rows[i] - 1), name, time / 1000000.0);
+		free(band_in[i]);
+		free(band_out[i]);
+		delete sessions[i];
+	}
+	for (int i = 0; i < count; i++)
+		delete probes[i];
+
+	return longest;
+}
+
+/* Partition a device with props, returns how many sub-devices were created,
+   0 if it cannot be partitioned that way or would give more than max */
+cl_uint partition_device(cl_device_id dev, const cl_device_partition_property* props,
+	cl_device_id* subs, cl_uint max) {
+	cl_uint count;
+	cl_int err;
+
+	err = clCreateSubDevices(dev, props, 0, NULL, &count);
+	if (err < 0 || count > max)
+		return 0;
+	err = clCreateSubDevices(dev, props, count, subs, NULL);
+	if (err < 0)
+		return 0;
+
+	return count;
+}
+
+/*
+ * Partition a device into sub-devices, by NUMA affinity domain when units
+ * is 0, otherwise equally with units compute units each. A single NUMA
+ * domain gives nothing to spread jobs over, so the compute units are then
+ * shared equally between up to jobs sub-devices instead. Returns how many
+ * were created, 0 if the device cannot be split in two or more within max.
+ */
+cl_uint create_sub_devices(cl_device_id dev, cl_uint units, cl_uint jobs, cl_device_id* subs, cl_uint max) {
+	cl_device_partition_property props[3];
+	cl_uint count, compute_units;
+
+	props[2] = 0;
+	if (units == 0) {
+		props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+		count = partition_device(dev, props, subs, max);
+		if (count >= 2)
+			return count;
+		if (count == 1)
+			clReleaseDevice(subs[0]);
+
+		clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+		if (jobs > max)
+			jobs = max;
+		units = (compute_units + jobs - 1) / jobs;
+		if (units == 0 || compute_units / units < 2)
+			units = compute_units / 2;
+		if (units == 0)
+			return 0;
+	}
+
+	props[0] = CL_DEVICE_PARTITION_EQUALLY;
+	props[1] = units;
+	return partition_device(dev, props, subs, max);
+}
+
+/*
+ * Blur jobs copies of a frame as independent jobs handed out in turn to
+ * the sessions, each on its own device and queue, so up to count jobs run
+ * at once. Returns the device time from the first kernel start to the last
+ * kernel end in nanoseconds, all sessions must share one clock.
+ */
+double blur_jobs(BlurSession** sessions, int count, const unsigned char* input,
+	unsigned char* output, int jobs, int radius, float sigma) {
+	cl_ulong first_start = 0, last_end = 0;
+
+	for (int job = 0; job < jobs; job += count) {
+		int n = jobs - job < count ? jobs - job : count;
+
+		for (int i = 0; i < n; i++)
+			sessions[i]->start_blur(input, output + (size_t)i * sessions[i]->width * sessions[i]->height * CHANNELS,
+				radius, sigma);
+		for (int i = 0; i < n; i++) {
+			cl_ulong start, end;
+
+			sessions[i]->finish_blur(&start, &end);
+			if (first_start == 0 || start < first_start)
+				first_start = start;
+			if (end > last_end)
+				last_end = end;
 		}
+	}
+
+	return (double)(last_end - first_start);
+}
+
+int main(int argc, char **argv) {
+
+	/* Host/device data structures */
+	cl_device_id device;
+
+	/* Image data */
+	unsigned char* inputImage;
+	unsigned char* outputImages[NUM_MODES];
+	double sums[NUM_MODES];
+	bool runs[NUM_MODES];
 
-		clWaitForEvents(1, &evnt1);
-		clWaitForEvents(1, &evnt2a);
-		clWaitForEvents(1, &evnt2b);
+	cl_image_format img_format;
+	int w, h;
+	int radius;
+	float sigma;
 
-		clFinish(queue);
+	std::cout << "Please enter the blur radius: ";
+	std::cin >> radius;
+	std::cin.ignore(100, '\n');
+	if (radius < 1) {
+		radius = 1;
+	}
 
-		cl_ulong time_start_1, time_start_2a, time_start_2b;
-		cl_ulong time_end_1, time_end_2a, time_end_2b;
+	std::cout << "Please enter sigma (0 for radius / 3): ";
+	std::cin >> sigma;
+	std::cin.ignore(100, '\n');
+	if (sigma <= 0) {
+		sigma = default_sigma(radius);
+	}
 
-		clGetEventProfilingInfo(evnt1, CL_PROFILING_COMMAND_START, sizeof(time_start_1), &time_start_1, NULL);
-		clGetEventProfilingInfo(evnt2a, CL_PROFILING_COMMAND_START, sizeof(time_start_2a), &time_start_2a, NULL);
-		clGetEventProfilingInfo(evnt2b, CL_PROFILING_COMMAND_START, sizeof(time_start_2b), &time_start_2b, NULL);
+	/* Open input file and read image data */
+#if GREYSCALE
+	inputImage = readGreyscaleImage(GREY_INPUT_FILE, &w, &h);
+#else
+	inputImage = readRGBImage(INPUT_FILE, &w, &h);
+#endif
 
-		clGetEventProfilingInfo(evnt1, CL_PROFILING_COMMAND_END, sizeof(time_end_1), &time_end_1, NULL);
-		clGetEventProfilingInfo(evnt2a, CL_PROFILING_COMMAND_END, sizeof(time_end_2a), &time_end_2a, NULL);
-		clGetEventProfilingInfo(evnt2b, CL_PROFILING_COMMAND_END, sizeof(time_end_2b), &time_end_2b, NULL);
+	/* Create a device */
+	device = create_device();
 
+	print_device(device);
 
-		double nanoSeconds_1 = time_end_1 - time_start_1;
-		double nanoSeconds_2a = time_end_2a - time_start_2a;
-		double nanoSeconds_2b = time_end_2b - time_start_2b;
+	/* Create the session once, every round reuses its images and kernels */
+	img_format.image_channel_order = GREYSCALE ? CL_R : CL_RGBA;
+	img_format.image_channel_data_type = CL_UNORM_INT8;
 
+	/* Frames too large for the device skip the benchmark and are only blurred tile by tile */
+	size_t columns = strip_columns(device, w, radius);
+	size_t tile_width = columns < (size_t)w ? columns + 2 * radius : w;
+	size_t strip = strip_rows(device, tile_width, h, radius, BYTES_PER_PIXEL);
+	if (strip < (size_t)h || columns < (size_t)w) {
+		size_t tile_height = strip < (size_t)h ? strip + 2 * radius : h;
+		BlurSession* strip_session = new BlurSession(device, tile_width, tile_height, img_format);
+		unsigned char* outputImage = (unsigned char*)malloc((size_t)w * h * CHANNELS);
+		double strip_time = blur_tiles(strip_session, inputImage, outputImage, w, h,
+			columns, strip, radius, sigma);
+
+		printf("Blurred %d tiles of %d by %d pixels in %0.3f milliseconds\n",
+			(int)(((w + columns - 1) / columns) * ((h + strip - 1) / strip)),
+			(int)columns, (int)strip, strip_time / 1000000.0);
+		store_frame(outputImage, OUTPUT_FILE_STRIPS, h, w);
+		getchar();
 
-		sum1 += nanoSeconds_1;
-		sum2 += nanoSeconds_2a;
-		sum2 += nanoSeconds_2b;
+		free(inputImage);
+		free(outputImage);
+		delete strip_session;
+		return 0;
+	}
 
-		clReleaseMemObject(input_image);
-		clReleaseMemObject(output_image1);
-		clReleaseMemObject(output_image2);
-		clReleaseMemObject(output_input);
+	BlurSession* session = new BlurSession(device, w, h, img_format);
+	if (session->half_intermediate)
+		printf("Separable passes keep their intermediate at half precision\n");
+#if HALF_INTERMEDIATES
+	else
+		printf("Half precision images are not supported, intermediates stay 8-bit\n");
+#endif
 
+	for (int m = 0; m < NUM_MODES; m++) {
+		outputImages[m] = (unsigned char*)malloc(sizeof(unsigned char)*(size_t)w*h * CHANNELS);
+		sums[m] = 0;
+		runs[m] = !blur_modes[m].needs_2d_filter || session->naive_supported(radius);
+		if (!runs[m])
+			printf("Radius %d is too large for the %s kernel, skipping it\n", radius, blur_modes[m].name);
+		if (blur_modes[m].needs_rgba && GREYSCALE)
+			runs[m] = false;
+	}
 
-		//free(inputImage);
-		if (i < NUM_ROUNDS - 1) {
-			free(outputImage1);
-			free(outputinput);
-			free(outputImage2);
+	for (int i = 0; i < NUM_ROUNDS; i++)
+	{
+		for (int m = 0; m < NUM_MODES; m++) {
+			if (runs[m])
+				sums[m] += (session->*blur_modes[m].run)(inputImage, outputImages[m], radius, sigma);
 		}
 	}
 
    /* Create output BMP file and write data */
-   storeRGBImage(outputImage1, OUTPUT_FILE_1, h, w, INPUT_FILE);
-   storeRGBImage(outputImage2, OUTPUT_FILE_2, h, w, INPUT_FILE);
+   for (int m = 0; m < NUM_MODES; m++) {
+      if (runs[m])
+         store_frame(outputImages[m], blur_modes[m].output_file, h, w);
+   }
 
    std::cout << "\nTested " << NUM_ROUNDS << " times:" << std::endl;
-   printf("\tAverage naive Execution time is: %0.3f milliseconds \n", (sum1/NUM_ROUNDS) / 1000000.0);
-   printf("\tAverage two pass Execution time is: %0.3f milliseconds \n", (sum2/NUM_ROUNDS) / 1000000.0);
+   for (int m = 0; m < NUM_MODES; m++) {
+      if (runs[m])
+         printf("\tAverage %s Execution time is: %0.3f milliseconds \n", blur_modes[m].name, (sums[m]/NUM_ROUNDS) / 1000000.0);
+   }
+#if COMPARE_LINEAR
+   printf("\tLinear sampler differs from two pass by at most %d \n",
+      max_difference(outputImages[MODE_TWO_PASS], outputImages[MODE_LINEAR], (size_t)w*h, CHANNELS));
+#endif
+#if COMPARE_FIXED
+   if (runs[MODE_NAIVE] && runs[MODE_NAIVE_FIXED])
+      printf("\tFixed-point naive differs from float naive by at most %d \n",
+         max_difference(outputImages[MODE_NAIVE], outputImages[MODE_NAIVE_FIXED], (size_t)w*h, CHANNELS));
+   if (runs[MODE_TWO_PASS_FIXED])
+      printf("\tFixed-point two pass differs from float two pass by at most %d \n",
+         max_difference(outputImages[MODE_TWO_PASS], outputImages[MODE_TWO_PASS_FIXED], (size_t)w*h, CHANNELS));
+#endif
+
+   /* Meter the input in a grid of regions from its summed-area table */
+   cl_int regions[METERING_GRID * METERING_GRID * 4];
+   float region_sums[METERING_GRID * METERING_GRID];
+   for (int y = 0; y < METERING_GRID; y++) {
+      for (int x = 0; x < METERING_GRID; x++) {
+         cl_int* r = &regions[(y * METERING_GRID + x) * 4];
+         r[0] = x * w / METERING_GRID;
+         r[1] = y * h / METERING_GRID;
+         r[2] = (x + 1) * w / METERING_GRID - 1;
+         r[3] = (y + 1) * h / METERING_GRID - 1;
+      }
+   }
+   session->region_luminance(inputImage, regions, METERING_GRID * METERING_GRID, region_sums);
+   std::cout << "\nAverage luminance by region:" << std::endl;
+   for (int y = 0; y < METERING_GRID; y++) {
+      for (int x = 0; x < METERING_GRID; x++) {
+         cl_int* r = &regions[(y * METERING_GRID + x) * 4];
+         printf("\t%7.2f", region_sums[y * METERING_GRID + x] / ((r[2] - r[0] + 1) * (r[3] - r[1] + 1)));
+      }
+      printf("\n");
+   }
+
+#if RUN_AUTO
+   /* Calibrate on this device, then let the model pick the mode at the
+      requested radius and at doubling radii around it */
+   BlurPlanner* planner = new BlurPlanner(session);
+   planner->calibrate(inputImage, outputImages[0]);
+   planner->blur_auto(inputImage, outputImages[0], radius, sigma);
+   store_frame(outputImages[0], OUTPUT_FILE_AUTO, h, w);
+   for (int r = 1; r <= CROSSOVER_MAX_RADIUS; r *= 2)
+      planner->blur_auto(inputImage, outputImages[0], r);
+   planner->report();
+   std::cout << "\nPredicted choice at radius " << radius << " by frame size:" << std::endl;
+   for (size_t side = PROBE_SIDE; side <= 8192; side *= 4) {
+      int mode = planner->choose(radius, side, side);
+      if (mode >= 0)
+         printf("\t%5dx%-5d %-18s %14.3f ms\n", (int)side, (int)side, blur_modes[mode].name,
+            planner->predict(mode, radius, side, side) / 1000000.0);
+   }
+   delete planner;
+#endif
+
+#if BATCH_FRAMES > 0
+   /* Blur copies of the input as one batch against the same number of single launches */
+   size_t frame_bytes = (size_t)w * h * CHANNELS;
+   unsigned char* batch_in = (unsigned char*)malloc(frame_bytes * BATCH_FRAMES);
+   unsigned char* batch_out = (unsigned char*)malloc(frame_bytes * BATCH_FRAMES);
+   double single_time = 0, batch_time, single_wall, batch_wall;
+   for (int i = 0; i < BATCH_FRAMES; i++)
+      memcpy(batch_in + i * frame_bytes, inputImage, frame_bytes);
+   /* Wall clock around the enqueues and the finish, the launch overhead
+      batching removes is not in the kernel events */
+   single_wall = wall_time();
+   for (int i = 0; i < BATCH_FRAMES; i++)
+      single_time += session->blur(inputImage, outputImages[0], radius, sigma);
+   clFinish(session->queue);
+   single_wall = wall_time() - single_wall;
+   batch_wall = wall_time();
+   batch_time = session->blur_batch(batch_in, batch_out, BATCH_FRAMES, radius, sigma);
+   clFinish(session->queue);
+   batch_wall = wall_time() - batch_wall;
+   std::cout << "\nBatch of " << BATCH_FRAMES << " frames:" << std::endl;
+   printf("\tOne launch per frame: %0.3f milliseconds, %0.3f in kernels\n",
+      single_wall / 1000000.0, single_time / 1000000.0);
+   printf("\tOne launch per batch: %0.3f milliseconds, %0.3f in kernels\n",
+      batch_wall / 1000000.0, batch_time / 1000000.0);
+   printf("\tLast frame differs from two pass by at most %d \n",
+      max_difference(outputImages[0], batch_out + (BATCH_FRAMES - 1) * frame_bytes, (size_t)w*h, CHANNELS));
+   free(batch_in);
+   free(batch_out);
+#endif
+
+#if STRIP_ROWS > 0
+   /* Blur the frame again in strips and check the seams against the whole frame */
+   if (runs[MODE_TWO_PASS] && STRIP_ROWS < h) {
+      BlurSession* strip_session = new BlurSession(device, w, STRIP_ROWS + 2 * radius, img_format);
+      double strip_time = blur_tiles(strip_session, inputImage, outputImages[0], w, h,
+         w, STRIP_ROWS, radius, sigma);
+      std::cout << "\nStrips of " << STRIP_ROWS << " rows:" << std::endl;
+      printf("\tBlurred in %0.3f milliseconds\n", strip_time / 1000000.0);
+      printf("\tStitched frame differs from two pass by at most %d \n",
+         max_difference(outputImages[MODE_TWO_PASS], outputImages[0], (size_t)w*h, CHANNELS));
+      store_frame(outputImages[0], OUTPUT_FILE_STRIPS, h, w);
+      delete strip_session;
+   }
+#endif
+
+#if RUN_MULTI_DEVICE
+   /* Split the frame across every device and check the seams against one device */
+   cl_device_id devices[MAX_DEVICES];
+   int device_count = all_devices(devices, MAX_DEVICES);
+   if (runs[MODE_TWO_PASS] && device_count > 0) {
+      std::cout << "\nSplit across " << device_count << " device(s):" << std::endl;
+      double multi_time = blur_multi_device(devices, device_count, img_format, inputImage,
+         outputImages[0], w, h, radius, sigma);
+      printf("\tSlowest band took %0.3f milliseconds\n", multi_time / 1000000.0);
+      printf("\tReassembled frame differs from two pass by at most %d \n",
+         max_difference(outputImages[MODE_TWO_PASS], outputImages[0], (size_t)w*h, CHANNELS));
+      store_frame(outputImages[0], OUTPUT_FILE_MULTI, h, w);
+   }
+#endif
+
+#if RUN_FISSION
+   /* Many small jobs at once on sub-devices of a CPU against one after another on the whole CPU */
+   cl_device_type device_type;
+   cl_device_id subs[MAX_SUB_DEVICES];
+   cl_uint sub_count = 0;
+   clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+   if (device_type & CL_DEVICE_TYPE_CPU)
+      sub_count = create_sub_devices(device, FISSION_UNITS, FISSION_JOBS, subs, MAX_SUB_DEVICES);
+   if (!(device_type & CL_DEVICE_TYPE_CPU))
+      printf("\nDevice fission is only tried on CPU devices\n");
+   else if (sub_count == 0)
+      printf("\nThe device could not be partitioned into sub-devices\n");
+   else {
+      BlurSession* sub_sessions[MAX_SUB_DEVICES];
+      unsigned char* job_out = (unsigned char*)malloc((size_t)w * h * CHANNELS * sub_count);
+      double whole_time, fission_time;
+      int job_diff = 0;
+
+      for (cl_uint i = 0; i < sub_count; i++)
+         sub_sessions[i] = new BlurSession(subs[i], w, h, img_format);
+      /* One untimed job each to build the kernels for this radius */
+      blur_jobs(&session, 1, inputImage, job_out, 1, radius, sigma);
+      blur_jobs(sub_sessions, sub_count, inputImage, job_out, sub_count, radius, sigma);
+
+      whole_time = blur_jobs(&session, 1, inputImage, job_out, FISSION_JOBS, radius, sigma);
+      fission_time = blur_jobs(sub_sessions, sub_count, inputImage, job_out, FISSION_JOBS, radius, sigma);
+      std::cout << "\n" << FISSION_JOBS << " jobs on " << sub_count << " sub-devices:" << std::endl;
+      printf("\tWhole device, one job at a time: %0.3f milliseconds\n", whole_time / 1000000.0);
+      printf("\tSub-devices, %d jobs at a time: %0.3f milliseconds\n", sub_count, fission_time / 1000000.0);
+      for (cl_uint i = 0; i < sub_count; i++) {
+         int diff = max_difference(outputImages[MODE_TWO_PASS], job_out + (size_t)i * w * h * CHANNELS,
+            (size_t)w*h, CHANNELS);
+         if (diff > job_diff)
+            job_diff = diff;
+      }
+      printf("\tSub-device jobs differ from two pass by at most %d \n", job_diff);
+
+      for (cl_uint i = 0; i < sub_count; i++) {
+         delete sub_sessions[i];
+         clReleaseDevice(subs[i]);
+      }
+      free(job_out);
+   }
+#endif
+
+#if RUN_CONVOLUTIONS
+   run_convolutions(session, inputImage, outputImages[0], w, h, sigma);
+#endif
+
+#if RUN_CROSSOVER
+   fft_crossover(session, inputImage, outputImages[0]);
+#endif
    getchar();
 
    /* Deallocate resources */
    free(inputImage);
-   /*free(outputImage1);
-   free(outputinput);
-   free(outputImage2);*/
-   clReleaseKernel(kernel1);
-   clReleaseKernel(kernel2a);
-   clReleaseKernel(kernel2b);
-   clReleaseCommandQueue(queue);
-   clReleaseProgram(program);
-   clReleaseContext(context);
+   for (int m = 0; m < NUM_MODES; m++)
+      free(outputImages[m]);
+   delete session;
    return 0;
 }
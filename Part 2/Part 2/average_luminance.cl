@@ -1,61 +1,197 @@
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | 
       CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST; 
 
-__kernel void image_to_data( read_only image2d_t src_image,
-							__global float* data, int height) {
-     /* Get pixel coordinate */
-   int2 coord = (int2)(get_global_id(0), get_global_id(1));
+/* Luminance of a normalized pixel. Built with -D GREYSCALE the frames are
+   CL_R images or uchar buffers and the single channel is the luminance */
+float luminance(float4 pixel) {
+#ifdef GREYSCALE
+   return pixel.s0;
+#else
+   return (pixel.s0 * 0.299f)+(pixel.s1 * 0.587f)+(pixel.s2 * 0.114f);
+#endif
+}
+
+#if defined(SUB_GROUPS) && defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+/* Luminance statistics on the 0-255 scale: the range, the pixel count, the
+   mean and m2, the sum of squared differences from the mean. The variance
+   is m2 / count. Only a work-item's own few pixels go through
+   E[x^2] - mean^2, the sets are combined without its cancellation */
+typedef struct {
+   float min;
+   float max;
+   uint count;
+   float mean;
+   float m2;
+} lum_stats;
+
+lum_stats stats_empty() {
+   lum_stats stats = { INFINITY, -INFINITY, 0, 0.0f, 0.0f };
+   return stats;
+}
+
+/* Add one pixel to a work-item's statistics. Until stats_finish the mean
+   and m2 hold the sum and the sum of squares, so there is no divide per
+   pixel */
+lum_stats stats_add(lum_stats stats, float lum) {
+   stats.min = fmin(stats.min, lum);
+   stats.max = fmax(stats.max, lum);
+   stats.count++;
+   stats.mean += lum;
+   stats.m2 += lum * lum;
+   return stats;
+}
 
-   /* Read pixel value */
-  float4 pixel = read_imagef(src_image, sampler, coord);
+/* Turn the sums stats_add leaves into the mean and m2, once per work-item
+   before its statistics are combined with others */
+lum_stats stats_finish(lum_stats stats) {
+   float sum = stats.mean;
 
-  int index = (get_global_id(0) * height) + get_global_id(1);
+   if(stats.count == 0)
+      return stats;
+   stats.mean = sum / stats.count;
+   stats.m2 = fmax(stats.m2 - sum * stats.mean, 0.0f);
+   return stats;
+}
 
-  data[index] = 255.0f*((pixel.s0 * 0.299)+(pixel.s1 * 0.587)+(pixel.s2 * 0.114));
+/* Chan's parallel combination of the statistics of two sets of pixels */
+lum_stats stats_combine(lum_stats a, lum_stats b) {
+   uint count = a.count + b.count;
+   float delta = b.mean - a.mean;
+   float share;
+
+   if(count == 0)
+      return a;
+   share = (float)b.count / count;
+   a.min = fmin(a.min, b.min);
+   a.max = fmax(a.max, b.max);
+   a.mean += delta * share;
+   a.m2 += b.m2 + delta * delta * a.count * share;
+   a.count = count;
+   return a;
 }
 
-__kernel void reduction_vector(__global float4* data, 
-      __local float4* partial_sums) {
+/* Statistics of value over the work-group, valid in work-item 0. Built with
+   -D WORK_GROUP_REDUCE it is work_group_reduce_min/max/add, with
+   -D SUB_GROUPS a sub_group_reduce in every sub-group and one barrier
+   before work-item 0 combines the sub-group results, otherwise the local
+   memory tree with a barrier at every step, which needs a power of two
+   work-group. The reductions combine many sets at once, m2 gathering each
+   set's squared distance from the combined mean the way stats_combine
+   does for two */
+#if defined(WORK_GROUP_REDUCE)
+#define GROUP_REDUCE(op, x) work_group_reduce_##op(x)
+#elif defined(SUB_GROUPS)
+#define GROUP_REDUCE(op, x) sub_group_reduce_##op(x)
+#endif
+
+lum_stats group_stats(lum_stats value, __local lum_stats* partial_stats) {
+#if defined(WORK_GROUP_REDUCE) || defined(SUB_GROUPS)
+   lum_stats stats;
+   float weighted = GROUP_REDUCE(add, value.count * value.mean);
+   float delta;
+
+   stats.min = GROUP_REDUCE(min, value.min);
+   stats.max = GROUP_REDUCE(max, value.max);
+   stats.count = GROUP_REDUCE(add, value.count);
+   stats.mean = stats.count > 0 ? weighted / stats.count : 0.0f;
+   delta = value.mean - stats.mean;
+   stats.m2 = GROUP_REDUCE(add, value.m2 + value.count * delta * delta);
+#if defined(SUB_GROUPS)
+   if(get_sub_group_local_id() == 0)
+      partial_stats[get_sub_group_id()] = stats;
+   barrier(CLK_LOCAL_MEM_FENCE);
 
+   if(get_local_id(0) == 0) {
+      for(uint i = 1; i < get_num_sub_groups(); i++)
+         stats = stats_combine(stats, partial_stats[i]);
+   }
+#endif
+   return stats;
+#else
    int lid = get_local_id(0);
    int group_size = get_local_size(0);
 
-   partial_sums[lid] = data[get_global_id(0)];
+   partial_stats[lid] = value;
    barrier(CLK_LOCAL_MEM_FENCE);
 
    for(int i = group_size/2; i>0; i >>= 1) {
       if(lid < i) {
-         partial_sums[lid] += partial_sums[lid + i];
+         partial_stats[lid] = stats_combine(partial_stats[lid], partial_stats[lid + i]);
       }
       barrier(CLK_LOCAL_MEM_FENCE);
    }
+   return partial_stats[0];
+#endif
+}
+
+/* Luminance on the 0-255 scale of pixel index of an image of width pixels
+   per row, in row-major order */
+float image_luminance(read_only image2d_t src_image, int index, int width) {
+   float4 pixel = read_imagef(src_image, sampler, (int2)(index % width, index / width));
+   return 255.0f*luminance(pixel);
+}
+
+/* Minimum, maximum, count, mean and m2 of the luminance of a frame in a
+   single pass, one lum_stats of partial statistics per work-group for
+   stats_complete, no per-pixel buffer is written. Any number of
+   work-groups covers a frame of any size, each work-item striding over it */
+__kernel void image_luminance_stats(read_only image2d_t src_image,
+      __local lum_stats* partial_stats, __global lum_stats* partials, int width, int height) {
 
+   int lid = get_local_id(0);
+   lum_stats stats = stats_empty();
+
+   for(int index = get_global_id(0); index < width * height; index += get_global_size(0)) {
+      stats = stats_add(stats, image_luminance(src_image, index, width));
+   }
+   stats = group_stats(stats_finish(stats), partial_stats);
    if(lid == 0) {
-      data[get_group_id(0)] = partial_sums[0];
+      partials[get_group_id(0)] = stats;
    }
 }
 
+/* Buffer backend counterpart of image_luminance_stats, reading a frame of
+   pixels uchar4 values, or uchar values when built with -D GREYSCALE */
+#ifdef GREYSCALE
+typedef uchar frame_t;
+#define frame_pixel(p) ((float4)((float)(p), 0.0f, 0.0f, 0.0f))
+#else
+typedef uchar4 frame_t;
+#define frame_pixel(p) convert_float4(p)
+#endif
 
-__kernel void reduction_complete(__global float4* data, 
-      __local float4* partial_sums, __global float* sum) {
+__kernel void buffer_luminance_stats(__global const frame_t* src,
+      __local lum_stats* partial_stats, __global lum_stats* partials, int pixels) {
 
    int lid = get_local_id(0);
-   int group_size = get_local_size(0);
-
-   partial_sums[lid] = data[get_local_id(0)];
-   barrier(CLK_LOCAL_MEM_FENCE);
+   lum_stats stats = stats_empty();
 
-   for(int i = group_size/2; i>0; i >>= 1) {
-      if(lid < i) {
-         partial_sums[lid] += partial_sums[lid + i];
-      }
-      barrier(CLK_LOCAL_MEM_FENCE);
+   for(int index = get_global_id(0); index < pixels; index += get_global_size(0)) {
+      stats = stats_add(stats, luminance(frame_pixel(src[index])));
    }
-
+   stats = group_stats(stats_finish(stats), partial_stats);
    if(lid == 0) {
-      *sum = partial_sums[0].s0 + partial_sums[0].s1 +
-             partial_sums[0].s2 + partial_sums[0].s3;
+      partials[get_group_id(0)] = stats;
    }
 }
 
+/* Combine count partial statistics, run as a single work-group whose size
+   is a power of two */
+__kernel void stats_complete(__global lum_stats* partials,
+      __local lum_stats* partial_stats, __global lum_stats* result, int count) {
 
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+   lum_stats stats = stats_empty();
+
+   for(int i = lid; i < count; i += group_size) {
+      stats = stats_combine(stats, partials[i]);
+   }
+   stats = group_stats(stats, partial_stats);
+   if(lid == 0) {
+      *result = stats;
+   }
+}
@@ -1,11 +1,35 @@
 #define _CRT_SECURE_NO_WARNINGS
 #define INPUT_FILE "lena.bmp"
+#define GREY_INPUT_FILE "lena_grey.bmp"
 #define OUTPUT_FILE "output.bmp"
 #define PROGRAM_FILE "average_luminance.cl"
 
-#define KERNEL_1 "image_to_data"
-#define KERNEL_2a "reduction_vector"
-#define KERNEL_2b "reduction_complete"
+#define KERNEL_1 "image_luminance_stats"
+#define KERNEL_1B "buffer_luminance_stats"
+#define KERNEL_2 "stats_complete"
+
+/* Set to 1 to reduce work-groups with sub-group reductions rather than
+   the work_group_reduce functions on devices that support both */
+#define PREFER_SUB_GROUPS 0
+
+/* Work-groups per compute unit for the luminance stage, each work-item
+   strides over the frame so this fixes the launch size, not the coverage */
+#define GROUPS_PER_UNIT 4
+
+/* Frames that do not fit in 1/STRIP_MEMORY_FRACTION of the device memory,
+   or exceed the image size limits, are read in tiles and their statistics
+   combined on the host. Set STRIP_ROWS to force strips of that many rows */
+#define STRIP_ROWS 0
+#define STRIP_MEMORY_FRACTION 4
+
+/* Set to 1 to upload the frame as a plain uchar4 buffer instead of an image,
+   faster on devices that emulate image objects */
+#define USE_BUFFERS 0
+
+/* Set to 1 to read GREY_INPUT_FILE as one byte per pixel into a CL_R image
+   or uchar buffer, the byte is the luminance */
+#define GREYSCALE 0
+#define CHANNELS (GREYSCALE ? 1 : 4)
 
 #include <math.h>
 #include <stdio.h>
@@ -48,8 +72,9 @@ cl_device_id create_device() {
 	return dev;
 }
 
-/* Create program from a file and compile it */
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+/* Create program from a file and compile it, options may be NULL */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
+	const char* options = NULL) {
 
 	cl_program program;
 	FILE *program_handle;
@@ -81,7 +106,7 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
 	free(program_buffer);
 
 	/* Build program */
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
 	if (err < 0) {
 
 		/* Find size of log and print to std output */
@@ -99,11 +124,118 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
 	return program;
 }
 
-double avg_lum(unsigned char* image, int size) {
+/*
+ * Append the build options that pick how work-groups reduce: the
+ * work_group_reduce functions on OpenCL C 2.x devices and on 3.0 devices
+ * with __opencl_c_work_group_collective_functions, sub-group reductions
+ * with cl_khr_subgroups or cl_intel_subgroups, the local memory tree
+ * otherwise. PREFER_SUB_GROUPS picks sub-groups when a device has
+ * both. Returns the name of the choice.
+ */
+const char* reduction_options(cl_device_id dev, char* options) {
+	char version[64];
+	char* extensions;
+	size_t size;
+	bool work_groups, sub_groups, version_3 = false;
+
+	clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, sizeof(version), version, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+	extensions = (char*)malloc(size);
+	clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+	work_groups = strncmp(version, "OpenCL C 2.", 11) == 0;
+	sub_groups = strstr(extensions, "cl_khr_subgroups") != NULL ||
+		strstr(extensions, "cl_intel_subgroups") != NULL;
+	free(extensions);
+
+#ifdef CL_DEVICE_OPENCL_C_FEATURES
+	/* OpenCL C 3.0 makes the collectives optional, reported as a feature */
+	if (strncmp(version, "OpenCL C 3.", 11) == 0) {
+		cl_name_version* features;
+
+		clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_FEATURES, 0, NULL, &size);
+		features = (cl_name_version*)malloc(size);
+		clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_FEATURES, size, features, NULL);
+		for (size_t i = 0; i < size / sizeof(cl_name_version); i++) {
+			if (strcmp(features[i].name, "__opencl_c_work_group_collective_functions") == 0)
+				version_3 = true;
+		}
+		free(features);
+	}
+#endif
+
+	if (version_3) {
+		work_groups = true;
+		strcat(options, " -cl-std=CL3.0");
+	}
+	else if (work_groups)
+		strcat(options, " -cl-std=CL2.0");
+	if (sub_groups && (PREFER_SUB_GROUPS || !work_groups)) {
+		strcat(options, " -D SUB_GROUPS");
+		return "sub-group reductions";
+	}
+	if (work_groups) {
+		strcat(options, " -D WORK_GROUP_REDUCE");
+		return "work-group reductions";
+	}
+	return "local memory tree";
+}
+
+/* Luminance statistics on the 0-255 scale, matching lum_stats in the kernels.
+   m2 is the sum of squared differences from the mean */
+typedef struct {
+	cl_float min;
+	cl_float max;
+	cl_uint count;
+	cl_float mean;
+	cl_float m2;
+} LumStats;
+
+/*
+ * Columns and rows of the tiles a frame is read in, so that a tile fits the
+ * image size limits, a single allocation and 1/STRIP_MEMORY_FRACTION of the
+ * global memory. The luminance needs no halo, so tiles do not overlap.
+ * Gives the whole frame when it fits.
+ */
+void tile_size(cl_device_id dev, size_t width, size_t height, size_t* columns, size_t* rows) {
+	cl_ulong global_mem, max_alloc;
+	size_t max_width, max_height;
+
+	clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(max_width), &max_width, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(max_height), &max_height, NULL);
+#if USE_BUFFERS
+	max_width = width;
+	max_height = height;
+#endif
+
+	*columns = width < max_width ? width : max_width;
+	*rows = (size_t)(global_mem / STRIP_MEMORY_FRACTION / (CHANNELS * *columns));
+	if (*rows > max_alloc / (CHANNELS * *columns))
+		*rows = (size_t)(max_alloc / (CHANNELS * *columns));
+	if (*rows > max_height)
+		*rows = max_height;
+	if (STRIP_ROWS > 0 && *rows > STRIP_ROWS)
+		*rows = STRIP_ROWS;
+	if (*rows > height)
+		*rows = height;
+	if (*rows == 0) {
+		printf("Not enough device memory for a row of the frame\n");
+		exit(1);
+	}
+}
+
+double avg_lum(unsigned char* image, size_t size) {
 	double avg = 0;
-	for (int i = 0; i < size * 4; i += 4) {
+#if GREYSCALE
+	for (size_t i = 0; i < size; i++) {
+		avg += image[i];
+	}
+#else
+	for (size_t i = 0; i < size * 4; i += 4) {
 		avg += ((image[i + 0] * 0.299) + (image[i + 1] * 0.587) + (image[i + 2] * 0.114));
 	}
+#endif
 	avg /= size;
 	return avg;
 }
@@ -121,12 +253,16 @@ int main(int argc, char **argv) {
    int w, h;
 
    /* Open input file and read image data */
+#if GREYSCALE
+   inputImage = readGreyscaleImage(GREY_INPUT_FILE, &w, &h);
+#else
    inputImage = readRGBImage(INPUT_FILE, &w, &h);
+#endif
    width = w;
    height = h;
-   outputImage = (unsigned char*)malloc(sizeof(unsigned char)*w*h*4);
+   outputImage = (unsigned char*)malloc(sizeof(unsigned char)*width*height*CHANNELS);
   
-   std::cout << "Average luminance: " << avg_lum(inputImage, w*h) << std::endl;
+   std::cout << "Average luminance: " << avg_lum(inputImage, width*height) << std::endl;
 
    std::cout << "Please press ENTER enter to see parallel reduction results." << std::endl;
    getchar();
@@ -136,28 +272,34 @@ int main(int argc, char **argv) {
    cl_device_id device;
    cl_context context;
    cl_program program;
-   cl_kernel vector_kernel, complete_kernel, transform_kernel;
+   cl_kernel complete_kernel, luminance_kernel;
    cl_command_queue queue;
    cl_int err;
-   size_t loc_size, glob_size, global_size[2];
+   size_t loc_size, glob_size, groups;
+   cl_uint compute_units;
 
-   img_format.image_channel_order = CL_RGBA;
+   img_format.image_channel_order = GREYSCALE ? CL_R : CL_RGBA;
    img_format.image_channel_data_type = CL_UNORM_INT8;
 
    /* Data and buffers */
-   float *data = new float[w*h];
-   float sum;
-   cl_mem data_buffer, sum_buffer, image_data;
+   LumStats stats;
+   double variance;
+   cl_mem partial_buffer, stats_buffer;
 
 
    /* Create device and determine local size */
    device = create_device();
    err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
 	   sizeof(loc_size), &loc_size, NULL);
+   err |= clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+	   sizeof(compute_units), &compute_units, NULL);
    if (err < 0) {
 	   perror("Couldn't obtain device information");
 	   exit(1);
    }
+   /* The tree reductions halve the work-group, keep it a power of two */
+   while (loc_size & (loc_size - 1))
+	   loc_size &= loc_size - 1;
 
    /* Create a context */
    context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
@@ -167,7 +309,11 @@ int main(int argc, char **argv) {
    }
 
    /* Build program */
-   program = build_program(context, device, PROGRAM_FILE);
+   char options[96] = "";
+   if (GREYSCALE)
+	   strcat(options, "-D GREYSCALE");
+   std::cout << "Work-groups reduce with " << reduction_options(device, options) << std::endl;
+   program = build_program(context, device, PROGRAM_FILE, options);
 
 
    /* Create a command queue */
@@ -179,108 +325,159 @@ int main(int argc, char **argv) {
    };
 
    /* Create kernels */
-   transform_kernel = clCreateKernel(program, KERNEL_1, &err);
-   vector_kernel = clCreateKernel(program, KERNEL_2a, &err);
-   complete_kernel = clCreateKernel(program, KERNEL_2b, &err);
+#if USE_BUFFERS
+   luminance_kernel = clCreateKernel(program, KERNEL_1B, &err);
+#else
+   luminance_kernel = clCreateKernel(program, KERNEL_1, &err);
+#endif
+   complete_kernel = clCreateKernel(program, KERNEL_2, &err);
    if (err < 0) {
 	   perror("Couldn't create a kernel");
 	   exit(1);
    };
 
-   input_image = clCreateImage2D(context,
-	   CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-	   &img_format, width, height, 0, (void*)inputImage, &err);
-   image_data = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-	   sizeof(float)*w*h, NULL, &err);
+   /* The frame is read tile by tile when it is too large for the device,
+      as a single tile otherwise */
+   size_t columns, rows;
+   unsigned char* tile = NULL;
+   tile_size(device, width, height, &columns, &rows);
+   if (columns < width)
+	   tile = (unsigned char*)malloc(CHANNELS * columns * rows);
+#if USE_BUFFERS
+   input_image = clCreateBuffer(context, CL_MEM_READ_ONLY,
+	   CHANNELS * columns * rows, NULL, &err);
+#else
+   input_image = clCreateImage2D(context, CL_MEM_READ_ONLY,
+	   &img_format, columns, rows, 0, NULL, &err);
+#endif
    if (err < 0) {
-	   perror("Couldn't create a buffer");
-	   getchar();
+	   perror("Couldn't create the image object");
 	   exit(1);
    };
 
-   err = clSetKernelArg(transform_kernel, 0, sizeof(cl_mem), &input_image);
-   err |= clSetKernelArg(transform_kernel, 1, sizeof(cl_mem), &image_data);
-   err |= clSetKernelArg(transform_kernel, 2, sizeof(cl_int), &h);
-   if (err < 0) {
-	   perror("Couldn't create a kernel argument");
-	   getchar();
-	   exit(1);
-   }
-
-   global_size[0] = width; global_size[1] = height;
-   err = clEnqueueNDRangeKernel(queue, transform_kernel, 2, NULL, global_size,
-	   NULL, 0, NULL, NULL);
-
-   /* Read the result */
-   err = clEnqueueReadBuffer(queue, image_data, CL_TRUE, 0,
-	   w * h * sizeof(float), data, 0, NULL, NULL);
-   if (err < 0) {
-	   perror("Couldn't read the buffer");
-	   getchar();
-	   exit(1);
-   }
-
-   data_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE |
-	   CL_MEM_USE_HOST_PTR, w * h * sizeof(float), data, &err);
-   sum_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-	   sizeof(float), NULL, &err);
+   /* Luminance and the first reduction stage run as one launch of a fixed
+      number of work-groups, no more than a tile needs, each writing the
+      min, max, count, mean and m2 of its pixels as one LumStats. A single
+      work-group then combines the partials */
+   groups = compute_units * GROUPS_PER_UNIT;
+   if (groups > (columns*rows + loc_size - 1) / loc_size)
+	   groups = (columns*rows + loc_size - 1) / loc_size;
+   glob_size = groups * loc_size;
+   partial_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
+	   groups * sizeof(LumStats), NULL, &err);
+   stats_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+	   sizeof(LumStats), NULL, &err);
    if (err < 0) {
 	   perror("Couldn't create a buffer");
 	   exit(1);
    };
 
-   /* Set arguments for vector kernel */
-   err = clSetKernelArg(vector_kernel, 0, sizeof(cl_mem), &data_buffer);
-   err |= clSetKernelArg(vector_kernel, 1, loc_size * 4 * sizeof(float), NULL);
+   err = clSetKernelArg(luminance_kernel, 0, sizeof(cl_mem), &input_image);
+   err |= clSetKernelArg(luminance_kernel, 1, loc_size * sizeof(LumStats), NULL);
+   err |= clSetKernelArg(luminance_kernel, 2, sizeof(cl_mem), &partial_buffer);
 
    /* Set arguments for complete kernel */
-   err = clSetKernelArg(complete_kernel, 0, sizeof(cl_mem), &data_buffer);
-   err |= clSetKernelArg(complete_kernel, 1, loc_size * 4 * sizeof(float), NULL);
-   err |= clSetKernelArg(complete_kernel, 2, sizeof(cl_mem), &sum_buffer);
+   cl_int count = (cl_int)groups;
+   err |= clSetKernelArg(complete_kernel, 0, sizeof(cl_mem), &partial_buffer);
+   err |= clSetKernelArg(complete_kernel, 1, loc_size * sizeof(LumStats), NULL);
+   err |= clSetKernelArg(complete_kernel, 2, sizeof(cl_mem), &stats_buffer);
+   err |= clSetKernelArg(complete_kernel, 3, sizeof(cl_int), &count);
    if (err < 0) {
 	   perror("Couldn't create a kernel argument");
 	   exit(1);
    }
 
-   /* Enqueue kernels */
-   glob_size = (w*h)/ 4;
-   err = clEnqueueNDRangeKernel(queue, vector_kernel, 1, NULL, &glob_size,
-	   &loc_size, 0, NULL, NULL);
-   if (err < 0) {
-	   perror("Couldn't enqueue the kernel");
-	   exit(1);
-   }
-
-   /* Perform successive stages of the reduction */
-   while (glob_size / loc_size > loc_size) {
-	   glob_size = glob_size / loc_size;
-	   err = clEnqueueNDRangeKernel(queue, vector_kernel, 1, NULL, &glob_size,
-		   &loc_size, 0, NULL, NULL);
-	   if (err < 0) {
-		   perror("Couldn't enqueue the kernel");
-		   exit(1);
+   /* Each tile is reduced on the device, the tiles are combined on the host
+      in double precision with the same formula as stats_combine */
+   double lum_min = INFINITY, lum_max = -INFINITY, pixels_seen = 0, mean = 0, m2 = 0;
+   int tiles = 0;
+   for (size_t y0 = 0; y0 < height; y0 += rows) {
+	   size_t tile_h = height - y0 < rows ? height - y0 : rows;
+
+	   for (size_t x0 = 0; x0 < width; x0 += columns) {
+		   size_t tile_w = width - x0 < columns ? width - x0 : columns;
+		   const unsigned char* src = inputImage + y0 * width * CHANNELS;
+
+		   /* Whole rows are already packed, a narrower tile is gathered */
+		   if (tile != NULL) {
+			   for (size_t i = 0; i < tile_h; i++)
+				   memcpy(tile + i * tile_w * CHANNELS,
+					   inputImage + ((y0 + i) * width + x0) * CHANNELS, tile_w * CHANNELS);
+			   src = tile;
+		   }
+
+#if USE_BUFFERS
+		   cl_int pixels = (cl_int)(tile_w * tile_h);
+		   err = clEnqueueWriteBuffer(queue, input_image, CL_TRUE, 0,
+			   CHANNELS * tile_w * tile_h, src, 0, NULL, NULL);
+		   err |= clSetKernelArg(luminance_kernel, 3, sizeof(cl_int), &pixels);
+#else
+		   cl_int tw = (cl_int)tile_w, th = (cl_int)tile_h;
+		   origin[0] = 0; origin[1] = 0; origin[2] = 0;
+		   region[0] = tile_w; region[1] = tile_h; region[2] = 1;
+		   err = clEnqueueWriteImage(queue, input_image, CL_TRUE, origin,
+			   region, 0, 0, src, 0, NULL, NULL);
+		   err |= clSetKernelArg(luminance_kernel, 3, sizeof(cl_int), &tw);
+		   err |= clSetKernelArg(luminance_kernel, 4, sizeof(cl_int), &th);
+#endif
+		   if (err < 0) {
+			   perror("Couldn't write to the image object");
+			   exit(1);
+		   }
+
+		   /* Enqueue kernels */
+		   err = clEnqueueNDRangeKernel(queue, luminance_kernel, 1, NULL, &glob_size,
+			   &loc_size, 0, NULL, NULL);
+		   if (err < 0) {
+			   perror("Couldn't enqueue the kernel");
+			   exit(1);
+		   }
+
+		   err = clEnqueueNDRangeKernel(queue, complete_kernel, 1, NULL, &loc_size,
+			   &loc_size, 0, NULL, NULL);
+		   if (err < 0) {
+			   perror("Couldn't enqueue the kernel");
+			   exit(1);
+		   }
+
+		   /* Read the result */
+		   err = clEnqueueReadBuffer(queue, stats_buffer, CL_TRUE, 0,
+			   sizeof(LumStats), &stats, 0, NULL, NULL);
+		   if (err < 0) {
+			   perror("Couldn't read the buffer");
+			   exit(1);
+		   }
+
+		   if (stats.min < lum_min)
+			   lum_min = stats.min;
+		   if (stats.max > lum_max)
+			   lum_max = stats.max;
+		   if (stats.count > 0) {
+			   double delta = stats.mean - mean;
+			   double share = stats.count / (pixels_seen + stats.count);
+			   mean += delta * share;
+			   m2 += stats.m2 + delta * delta * pixels_seen * share;
+			   pixels_seen += stats.count;
+		   }
+		   tiles++;
 	   }
    }
-   glob_size = glob_size / loc_size;
-   err = clEnqueueNDRangeKernel(queue, complete_kernel, 1, NULL, &glob_size,
-	   NULL, 0, NULL, NULL);
-
-   /* Read the result */
-   err = clEnqueueReadBuffer(queue, sum_buffer, CL_TRUE, 0,
-	   sizeof(float), &sum, 0, NULL, NULL);
-   if (err < 0) {
-	   perror("Couldn't read the buffer");
-	   exit(1);
-   }
+   if (tiles > 1)
+	   printf("Read the frame in %d tiles of %d by %d pixels\n", tiles, (int)columns, (int)rows);
 
    /* Wait for key press before exiting */
-   std::cout << "Average luminance (found using parrellel reduction): " << sum/(h*w) << std::endl;
+   variance = pixels_seen > 0 ? m2 / pixels_seen : 0.0;
+   std::cout << "Average luminance (found using parrellel reduction): " << mean << std::endl;
+   printf("Luminance range %0.1f to %0.1f, standard deviation %0.2f\n",
+	   lum_min, lum_max, variance > 0 ? sqrt(variance) : 0.0);
    getchar();
 
    /* Deallocate resources */
-   clReleaseMemObject(sum_buffer);
-   clReleaseMemObject(data_buffer);
-   clReleaseKernel(vector_kernel);
+   clReleaseMemObject(stats_buffer);
+   clReleaseMemObject(partial_buffer);
+   clReleaseMemObject(input_image);
+   free(tile);
+   clReleaseKernel(luminance_kernel);
    clReleaseKernel(complete_kernel);
    clReleaseCommandQueue(queue);
    clReleaseProgram(program);
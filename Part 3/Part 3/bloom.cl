@@ -1,26 +1,253 @@
 __constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | 
       CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST; 
 
-__constant float SmartFilter1[3] = {0.27901, 0.44198, 0.27901};
-__constant float SmartFilter2[5] = {0.06136, 0.24477, 0.38774, 0.24477, 0.06136};
-__constant float SmartFilter3[7] = {0.00598, 0.060626, 0.241843, 0.383103, 0.241843, 0.060626, 0.00598};
+/* Building with -D RADIUS=n fixes the filter width at compile time so the
+   tap loops can be fully unrolled, otherwise the dim argument is used */
+#ifdef RADIUS
+#define FILTER_DIM (2*RADIUS + 1)
+#else
+#define FILTER_DIM dim
+#endif
+
+/* Luminance of a normalized pixel. Built with -D GREYSCALE the frames are
+   CL_R images or uchar buffers and the single channel is the luminance */
+float luminance(float4 pixel) {
+#ifdef GREYSCALE
+   return pixel.s0;
+#else
+   return (pixel.s0 * 0.299f)+(pixel.s1 * 0.587f)+(pixel.s2 * 0.114f);
+#endif
+}
 
+/* Blur weights are generated on the host for any radius and sigma and
+   passed in as a __constant buffer of dim values */
+
+#if defined(SUB_GROUPS) && defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+
+/* Luminance statistics on the 0-255 scale: the range, the pixel count, the
+   mean and m2, the sum of squared differences from the mean. The variance
+   is m2 / count. Only a work-item's own few pixels go through
+   E[x^2] - mean^2, the sets are combined without its cancellation */
+typedef struct {
+   float min;
+   float max;
+   uint count;
+   float mean;
+   float m2;
+} lum_stats;
+
+lum_stats stats_empty() {
+   lum_stats stats = { INFINITY, -INFINITY, 0, 0.0f, 0.0f };
+   return stats;
+}
 
-__kernel void image_to_data( read_only image2d_t src_image,
-							__global float* data, int height) {
-     /* Get pixel coordinate */
-   int2 coord = (int2)(get_global_id(0), get_global_id(1));
+/* Add one pixel to a work-item's statistics. Until stats_finish the mean
+   and m2 hold the sum and the sum of squares, so there is no divide per
+   pixel */
+lum_stats stats_add(lum_stats stats, float lum) {
+   stats.min = fmin(stats.min, lum);
+   stats.max = fmax(stats.max, lum);
+   stats.count++;
+   stats.mean += lum;
+   stats.m2 += lum * lum;
+   return stats;
+}
 
-   /* Read pixel value */
-  float4 pixel = read_imagef(src_image, sampler, coord);
+/* Turn the sums stats_add leaves into the mean and m2, once per work-item
+   before its statistics are combined with others */
+lum_stats stats_finish(lum_stats stats) {
+   float sum = stats.mean;
+
+   if(stats.count == 0)
+      return stats;
+   stats.mean = sum / stats.count;
+   stats.m2 = fmax(stats.m2 - sum * stats.mean, 0.0f);
+   return stats;
+}
+
+/* Chan's parallel combination of the statistics of two sets of pixels */
+lum_stats stats_combine(lum_stats a, lum_stats b) {
+   uint count = a.count + b.count;
+   float delta = b.mean - a.mean;
+   float share;
+
+   if(count == 0)
+      return a;
+   share = (float)b.count / count;
+   a.min = fmin(a.min, b.min);
+   a.max = fmax(a.max, b.max);
+   a.mean += delta * share;
+   a.m2 += b.m2 + delta * delta * a.count * share;
+   a.count = count;
+   return a;
+}
+
+/* Statistics of value over the work-group, valid in work-item 0. Built with
+   -D WORK_GROUP_REDUCE it is work_group_reduce_min/max/add, with
+   -D SUB_GROUPS a sub_group_reduce in every sub-group and one barrier
+   before work-item 0 combines the sub-group results, otherwise the local
+   memory tree with a barrier at every step, which needs a power of two
+   work-group. The reductions combine many sets at once, m2 gathering each
+   set's squared distance from the combined mean the way stats_combine
+   does for two */
+#if defined(WORK_GROUP_REDUCE)
+#define GROUP_REDUCE(op, x) work_group_reduce_##op(x)
+#elif defined(SUB_GROUPS)
+#define GROUP_REDUCE(op, x) sub_group_reduce_##op(x)
+#endif
+
+lum_stats group_stats(lum_stats value, __local lum_stats* partial_stats) {
+#if defined(WORK_GROUP_REDUCE) || defined(SUB_GROUPS)
+   lum_stats stats;
+   float weighted = GROUP_REDUCE(add, value.count * value.mean);
+   float delta;
+
+   stats.min = GROUP_REDUCE(min, value.min);
+   stats.max = GROUP_REDUCE(max, value.max);
+   stats.count = GROUP_REDUCE(add, value.count);
+   stats.mean = stats.count > 0 ? weighted / stats.count : 0.0f;
+   delta = value.mean - stats.mean;
+   stats.m2 = GROUP_REDUCE(add, value.m2 + value.count * delta * delta);
+#if defined(SUB_GROUPS)
+   if(get_sub_group_local_id() == 0)
+      partial_stats[get_sub_group_id()] = stats;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if(get_local_id(0) == 0) {
+      for(uint i = 1; i < get_num_sub_groups(); i++)
+         stats = stats_combine(stats, partial_stats[i]);
+   }
+#endif
+   return stats;
+#else
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+
+   partial_stats[lid] = value;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int i = group_size/2; i>0; i >>= 1) {
+      if(lid < i) {
+         partial_stats[lid] = stats_combine(partial_stats[lid], partial_stats[lid + i]);
+      }
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+   return partial_stats[0];
+#endif
+}
+
+/* Luminance on the 0-255 scale of pixel index of a width x height image in
+   row-major order, zero past the last pixel */
+float image_luminance(read_only image2d_t src_image, int index, int width, int height) {
+   if(index >= width * height)
+      return 0.0f;
 
-  int index = (get_global_id(0) * height) + get_global_id(1);
+   float4 pixel = read_imagef(src_image, sampler, (int2)(index % width, index / width));
+   return 255.0f*luminance(pixel);
+}
+
+/* Minimum, maximum, count, mean and m2 of the luminance of a frame in a
+   single pass, one lum_stats of partial statistics per work-group for
+   stats_complete. Any number of work-groups covers a frame of any size,
+   each work-item striding over it */
+__kernel void luminance_stats(read_only image2d_t src_image,
+      __local lum_stats* partial_stats, __global lum_stats* partials, int width, int height) {
+
+   int lid = get_local_id(0);
+   lum_stats stats = stats_empty();
 
-  data[index] = 255.0f*((pixel.s0 * 0.299)+(pixel.s1 * 0.587)+(pixel.s2 * 0.114));
+   for(int index = get_global_id(0); index < width * height; index += get_global_size(0)) {
+      stats = stats_add(stats, image_luminance(src_image, index, width, height));
+   }
+   stats = group_stats(stats_finish(stats), partial_stats);
+   if(lid == 0) {
+      partials[get_group_id(0)] = stats;
+   }
+}
+
+/* Luminance histograms have HISTOGRAM_BINS equal bins over 0-255 */
+#ifndef HISTOGRAM_BINS
+#define HISTOGRAM_BINS 256
+#endif
+
+int luminance_bin(float lum) {
+   return clamp((int)(lum * (HISTOGRAM_BINS / 256.0f)), 0, HISTOGRAM_BINS - 1);
+}
+
+/* Add the luminance of a frame to histogram, which must start zeroed. Each
+   work-group counts its pixels into private __local bins and merges them
+   with one global atomic per non-empty bin, so global atomics do not grow
+   with the frame */
+__kernel void luminance_histogram(read_only image2d_t src_image,
+      __global uint* histogram, int width, int height) {
+
+   __local uint bins[HISTOGRAM_BINS];
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+
+   for(int i = lid; i < HISTOGRAM_BINS; i += group_size)
+      bins[i] = 0;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int index = get_global_id(0); index < width * height; index += get_global_size(0))
+      atomic_inc(&bins[luminance_bin(image_luminance(src_image, index, width, height))]);
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int i = lid; i < HISTOGRAM_BINS; i += group_size) {
+      if(bins[i] != 0)
+         atomic_add(&histogram[i], bins[i]);
+   }
+}
+
+/* Luminance below which fraction of the pixels in histogram fall, the lower
+   edge of the bin where the running count reaches it. Runs as one
+   work-group: each work-item totals a run of bins, the run totals are
+   prefix summed in scan, and the work-item whose run holds the crossing
+   walks it and writes the result. Work-item 0 first writes 255, kept when
+   no run holds a crossing, as for an empty histogram */
+__kernel void histogram_percentile(__global const uint* histogram,
+      __local uint* scan, __global float* result, float fraction) {
+
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+   int run = (HISTOGRAM_BINS + group_size - 1) / group_size;
+   int first = min(lid * run, HISTOGRAM_BINS);
+   int last = min(first + run, HISTOGRAM_BINS);
+   uint count = 0;
+
+   if(lid == 0)
+      *result = 255.0f;
+   for(int i = first; i < last; i++)
+      count += histogram[i];
+   scan[lid] = count;
+   barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);
+
+   /* Inclusive scan of the run totals, doubling the offset each step */
+   for(int offset = 1; offset < group_size; offset <<= 1) {
+      uint value = lid >= offset ? scan[lid - offset] : 0;
+      barrier(CLK_LOCAL_MEM_FENCE);
+      scan[lid] += value;
+      barrier(CLK_LOCAL_MEM_FENCE);
+   }
+
+   float target = fraction * scan[group_size - 1];
+   uint before = scan[lid] - count;
+   if((float)before < target && (float)scan[lid] >= target) {
+      for(int i = first; i < last; i++) {
+         before += histogram[i];
+         if((float)before >= target) {
+            *result = i * (256.0f / HISTOGRAM_BINS);
+            return;
+         }
+      }
+   }
 }
 
 __kernel void smart_blur_verticle(read_only image2d_t src_image,
-					write_only image2d_t dst_image, int dim) {
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
 
 
    /* Get work-item’s row and column position */
@@ -37,10 +264,11 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
    float4 pixel;
 
 
-   int start = 0 - (int)floor(dim/2.0f);
-   int end = 0 + (int)floor(dim/2.0f);
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
 
       /* Iterate over the rows */
+   #pragma unroll
    for(int i = start; i <= end; i++) {
 	  coord.y =  row + i;
 	  coord.x = column;
@@ -48,12 +276,7 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
 	  	/* Read value pixel from the image */ 		
 		 pixel = read_imagef(src_image, sampler, coord);
 		 /* Acculumate weighted sum */
-		 if(dim == 3)
-			sum.xyz += pixel.xyz * SmartFilter1[filter_index++];
-		if(dim == 5)
-			sum.xyz += pixel.xyz * SmartFilter2[filter_index++];
-		if(dim == 7)
-			sum.xyz += pixel.xyz * SmartFilter3[filter_index++];
+		 sum.xyz += pixel.xyz * filter[filter_index++];
 
    }
 
@@ -62,7 +285,8 @@ __kernel void smart_blur_verticle(read_only image2d_t src_image,
 }
 
 __kernel void smart_blur_horizontal(read_only image2d_t src_image,
-					write_only image2d_t dst_image, int dim) {
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter) {
 
 
    /* Get work-item’s row and column position */
@@ -79,10 +303,11 @@ __kernel void smart_blur_horizontal(read_only image2d_t src_image,
    float4 pixel;
 
 
-   int start = 0 - (int)floor(dim/2.0f);
-   int end = 0 + (int)floor(dim/2.0f);
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
 
       /* Iterate over the rows */
+   #pragma unroll
    for(int i = start; i <= end; i++) {
 	  coord.y =  row;
 	  coord.x = column + i;
@@ -90,12 +315,7 @@ __kernel void smart_blur_horizontal(read_only image2d_t src_image,
 	  	/* Read value pixel from the image */ 		
 		 pixel = read_imagef(src_image, sampler, coord);
 		 /* Acculumate weighted sum */
-		 if(dim == 3)
-			sum.xyz += pixel.xyz * SmartFilter1[filter_index++];
-		if(dim == 5)
-			sum.xyz += pixel.xyz * SmartFilter2[filter_index++];
-		if(dim == 7)
-			sum.xyz += pixel.xyz * SmartFilter3[filter_index++];
+		 sum.xyz += pixel.xyz * filter[filter_index++];
 
    }
 
@@ -103,51 +323,109 @@ __kernel void smart_blur_horizontal(read_only image2d_t src_image,
 	  write_imagef(dst_image, coord, sum);
 }
 
-__kernel void reduction_vector(__global float4* data, 
-      __local float4* partial_sums) {
+/*
+ * Tiled variants of the separable passes. Each work-group loads its tile
+ * plus a radius wide halo into local memory once, then every tap is read
+ * from the tile instead of the image. The global size may be rounded up
+ * to a multiple of the local size, so writes outside the image are skipped.
+ */
+__kernel void smart_blur_verticle_tiled(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter, __local float4* tile) {
 
-   int lid = get_local_id(0);
-   int group_size = get_local_size(0);
 
-   partial_sums[lid] = data[get_global_id(0)];
-   barrier(CLK_LOCAL_MEM_FENCE);
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
 
-   for(int i = group_size/2; i>0; i >>= 1) {
-      if(lid < i) {
-         partial_sums[lid] += partial_sums[lid + i];
-      }
-      barrier(CLK_LOCAL_MEM_FENCE);
+   int lx = get_local_id(0);
+   int ly = get_local_id(1);
+   int lw = get_local_size(0);
+   int lh = get_local_size(1);
+
+   int radius = FILTER_DIM/2;
+   int tile_h = lh + 2*radius;
+
+   /* Image row held in the first row of the tile */
+   int top = get_group_id(1)*lh - radius;
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Load the tile and halo, the sampler clamps rows outside the image */
+   for(int i = ly; i < tile_h; i += lh) {
+      tile[i*lw + lx] = read_imagef(src_image, sampler, (int2)(column, top + i));
    }
+   barrier(CLK_LOCAL_MEM_FENCE);
 
-   if(lid == 0) {
-      data[get_group_id(0)] = partial_sums[0];
+   /* Iterate over the rows */
+   #pragma unroll
+   for(int i = 0; i < FILTER_DIM; i++) {
+      sum.xyz += tile[(ly + i)*lw + lx].xyz * filter[i];
    }
+
+   if(column < get_image_width(dst_image) && row < get_image_height(dst_image))
+      write_imagef(dst_image, (int2)(column, row), sum);
 }
 
-__kernel void reduction_complete(__global float4* data, 
-      __local float4* partial_sums, __global float* sum) {
+__kernel void smart_blur_horizontal_tiled(read_only image2d_t src_image,
+					write_only image2d_t dst_image, int dim,
+					__constant float* filter, __local float4* tile) {
 
-   int lid = get_local_id(0);
-   int group_size = get_local_size(0);
 
-   partial_sums[lid] = data[get_local_id(0)];
+   /* Get work-item’s row and column position */
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+
+   int lx = get_local_id(0);
+   int ly = get_local_id(1);
+   int lw = get_local_size(0);
+
+   int radius = FILTER_DIM/2;
+   int tile_w = lw + 2*radius;
+
+   /* Image column held in the first column of the tile */
+   int left = get_group_id(0)*lw - radius;
+
+   /* Accumulated pixel value */
+   float4 sum = (float4)(0.0);
+
+   /* Load the tile and halo, the sampler clamps columns outside the image */
+   for(int i = lx; i < tile_w; i += lw) {
+      tile[ly*tile_w + i] = read_imagef(src_image, sampler, (int2)(left + i, row));
+   }
    barrier(CLK_LOCAL_MEM_FENCE);
 
-   for(int i = group_size/2; i>0; i >>= 1) {
-      if(lid < i) {
-         partial_sums[lid] += partial_sums[lid + i];
-      }
-      barrier(CLK_LOCAL_MEM_FENCE);
+   /* Iterate over the columns */
+   #pragma unroll
+   for(int i = 0; i < FILTER_DIM; i++) {
+      sum.xyz += tile[ly*tile_w + lx + i].xyz * filter[i];
    }
 
+   if(column < get_image_width(dst_image) && row < get_image_height(dst_image))
+      write_imagef(dst_image, (int2)(column, row), sum);
+}
+
+/* Combine count partial statistics, run as a single work-group whose size
+   is a power of two */
+__kernel void stats_complete(__global lum_stats* partials,
+      __local lum_stats* partial_stats, __global lum_stats* result, int count) {
+
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+   lum_stats stats = stats_empty();
+
+   for(int i = lid; i < count; i += group_size) {
+      stats = stats_combine(stats, partials[i]);
+   }
+   stats = group_stats(stats, partial_stats);
    if(lid == 0) {
-      *sum = partial_sums[0].s0 + partial_sums[0].s1 +
-             partial_sums[0].s2 + partial_sums[0].s3;
+      *result = stats;
    }
 }
 
 bool test_lum(float4 pixel, float thres){
-	float lum = 1.0f*((pixel.s0 * 0.299)+(pixel.s1 * 0.587)+(pixel.s2 * 0.114));
+	float lum = luminance(pixel);
 
 	if(thres > lum)
 		return false;
@@ -188,4 +466,214 @@ __kernel void final_bloom_step(	read_only image2d_t src_image1, read_only image2
 
    /* Write new pixel value to output */
    write_imagef(dst_image, coord, pixel);
-}
\ No newline at end of file
+}
+
+/*
+ * Buffer backend. The same steps on __global uchar4 frames, uchar with
+ * GREYSCALE, of width pixels per row for devices that emulate image
+ * objects. Edges are clamped
+ * explicitly and results rounded back to 8 bits as a CL_UNORM_INT8 image
+ * write would. The blur global size may be rounded up, so writes outside
+ * the frame are skipped.
+ */
+#ifdef GREYSCALE
+typedef uchar frame_t;
+#define load_frame(p) ((float4)((float)(p), 0.0f, 0.0f, 0.0f))
+#define store_frame(v) convert_uchar_sat_rte((v).x)
+#else
+typedef uchar4 frame_t;
+#define load_frame(p) convert_float4(p)
+#define store_frame(v) convert_uchar4_sat_rte(v)
+#endif
+
+float4 read_clamped(__global const frame_t* src, int x, int y, int width, int height) {
+   x = clamp(x, 0, width - 1);
+   y = clamp(y, 0, height - 1);
+   return load_frame(src[y*width + x]) / 255.0f;
+}
+
+void write_unorm(__global frame_t* dst, int x, int y, int width, float4 pixel) {
+   dst[y*width + x] = store_frame(pixel * 255.0f);
+}
+
+float buffer_luminance(__global const frame_t* src, int index, int pixels) {
+   if(index >= pixels)
+      return 0.0f;
+
+   return luminance(load_frame(src[index]));
+}
+
+__kernel void luminance_stats_buffer(__global const frame_t* src,
+      __local lum_stats* partial_stats, __global lum_stats* partials, int pixels) {
+
+   int lid = get_local_id(0);
+   lum_stats stats = stats_empty();
+
+   for(int index = get_global_id(0); index < pixels; index += get_global_size(0)) {
+      stats = stats_add(stats, buffer_luminance(src, index, pixels));
+   }
+   stats = group_stats(stats_finish(stats), partial_stats);
+   if(lid == 0) {
+      partials[get_group_id(0)] = stats;
+   }
+}
+
+__kernel void luminance_histogram_buffer(__global const frame_t* src,
+      __global uint* histogram, int pixels) {
+
+   __local uint bins[HISTOGRAM_BINS];
+   int lid = get_local_id(0);
+   int group_size = get_local_size(0);
+
+   for(int i = lid; i < HISTOGRAM_BINS; i += group_size)
+      bins[i] = 0;
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int index = get_global_id(0); index < pixels; index += get_global_size(0))
+      atomic_inc(&bins[luminance_bin(buffer_luminance(src, index, pixels))]);
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   for(int i = lid; i < HISTOGRAM_BINS; i += group_size) {
+      if(bins[i] != 0)
+         atomic_add(&histogram[i], bins[i]);
+   }
+}
+
+__kernel void smart_blur_verticle_buffer(__global const frame_t* src,
+					__global frame_t* dst, int dim,
+					__constant float* filter, int width, int height) {
+
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+   float4 sum = (float4)(0.0);
+   int filter_index =  0;
+
+   if(column >= width || row >= height)
+      return;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   #pragma unroll
+   for(int i = start; i <= end; i++)
+      sum.xyz += read_clamped(src, column, row + i, width, height).xyz * filter[filter_index++];
+
+   write_unorm(dst, column, row, width, sum);
+}
+
+__kernel void smart_blur_horizontal_buffer(__global const frame_t* src,
+					__global frame_t* dst, int dim,
+					__constant float* filter, int width, int height) {
+
+   int column = get_global_id(0); 
+   int row = get_global_id(1);
+   float4 sum = (float4)(0.0);
+   int filter_index =  0;
+
+   if(column >= width || row >= height)
+      return;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   #pragma unroll
+   for(int i = start; i <= end; i++)
+      sum.xyz += read_clamped(src, column + i, row, width, height).xyz * filter[filter_index++];
+
+   write_unorm(dst, column, row, width, sum);
+}
+
+__kernel void output_pass_threshold_buffer(__global const frame_t* src,
+							__global frame_t* dst, float thres, int width) {
+
+   int index = get_global_id(1) * width + get_global_id(0);
+   float4 pixel = load_frame(src[index]) / 255.0f;
+
+   thres = thres/255.0f;
+   if(!test_lum(pixel, thres))
+	pixel = pixel * 0;
+
+   dst[index] = store_frame(pixel * 255.0f);
+}
+
+__kernel void final_bloom_step_buffer(__global const frame_t* src1, __global const frame_t* src2,
+							__global frame_t* dst, int width) {
+
+   int index = get_global_id(1) * width + get_global_id(0);
+
+   /* Saturating add, as the image write clamps the sum */
+   dst[index] = add_sat(src1[index], src2[index]);
+}
+
+/*
+ * Batched steps on image arrays. Each layer is a separate frame of the same
+ * size and the third global dimension selects the layer, so a whole batch
+ * goes through each step in one launch.
+ */
+__kernel void output_pass_threshold_array(read_only image2d_array_t src_image,
+							write_only image2d_array_t dst_image, float thres) {
+
+   int4 coord = (int4)(get_global_id(0), get_global_id(1), get_global_id(2), 0);
+   float4 pixel = read_imagef(src_image, sampler, coord);
+
+   thres = thres/255.0f;
+   if(!test_lum(pixel, thres))
+	pixel = pixel * 0;
+
+   write_imagef(dst_image, coord, pixel);
+}
+
+__kernel void smart_blur_verticle_array(read_only image2d_array_t src_image,
+					write_only image2d_array_t dst_image, int dim,
+					__constant float* filter) {
+
+   int4 coord = (int4)(get_global_id(0), 0, get_global_id(2), 0);
+   int row = get_global_id(1);
+   float4 sum = (float4)(0.0);
+   int filter_index =  0;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+	  coord.y = row + i;
+	  sum.xyz += read_imagef(src_image, sampler, coord).xyz * filter[filter_index++];
+   }
+
+   coord.y = row;
+   write_imagef(dst_image, coord, sum);
+}
+
+__kernel void smart_blur_horizontal_array(read_only image2d_array_t src_image,
+					write_only image2d_array_t dst_image, int dim,
+					__constant float* filter) {
+
+   int4 coord = (int4)(0, get_global_id(1), get_global_id(2), 0);
+   int column = get_global_id(0);
+   float4 sum = (float4)(0.0);
+   int filter_index =  0;
+
+   int start = 0 - FILTER_DIM/2;
+   int end = 0 + FILTER_DIM/2;
+
+   #pragma unroll
+   for(int i = start; i <= end; i++) {
+	  coord.x = column + i;
+	  sum.xyz += read_imagef(src_image, sampler, coord).xyz * filter[filter_index++];
+   }
+
+   coord.x = column;
+   write_imagef(dst_image, coord, sum);
+}
+
+__kernel void final_bloom_step_array(read_only image2d_array_t src_image1,
+							read_only image2d_array_t src_image2,
+							write_only image2d_array_t dst_image) {
+
+   int4 coord = (int4)(get_global_id(0), get_global_id(1), get_global_id(2), 0);
+
+   float4 pixel = read_imagef(src_image1, sampler, coord) + read_imagef(src_image2, sampler, coord);
+
+   write_imagef(dst_image, coord, pixel);
+}
@@ -1,16 +1,90 @@
 #define _CRT_SECURE_NO_WARNINGS
 #define PROGRAM_FILE "bloom.cl"
-#define KERNEL_T "image_to_data"
-#define KERNEL_1 "reduction_vector"
-#define KERNEL_2 "reduction_complete"
+#define KERNEL_2 "stats_complete"
+
+/* Set to 1 to keep every frame in a plain uchar4 buffer instead of an image,
+   faster on devices that emulate image objects */
+#define USE_BUFFERS 0
+
+/* Set to 1 to read GREY_INPUT_FILE as one byte per pixel and keep every
+   frame single channel, CL_R images or uchar buffers */
+#define GREYSCALE 0
+#define CHANNELS (GREYSCALE ? 1 : 4)
+
+#if USE_BUFFERS
+#define KERNEL_T "luminance_stats_buffer"
+#define KERNEL_HIST "luminance_histogram_buffer"
+#define KERNEL_3 "output_pass_threshold_buffer"
+#define KERNEL_4a "smart_blur_verticle_buffer"
+#define KERNEL_4b "smart_blur_horizontal_buffer"
+#define KERNEL_5 "final_bloom_step_buffer"
+#else
+#define KERNEL_T "luminance_stats"
+#define KERNEL_HIST "luminance_histogram"
 #define KERNEL_3 "output_pass_threshold"
-#define KERNEL_4a "smart_blur_verticle"
-#define KERNEL_4b "smart_blur_horizontal"
+#define KERNEL_4a "smart_blur_verticle_tiled"
+#define KERNEL_4b "smart_blur_horizontal_tiled"
 #define KERNEL_5 "final_bloom_step"
+#endif
+#define KERNEL_PERCENTILE "histogram_percentile"
+#define KERNEL_3_ARRAY "output_pass_threshold_array"
+#define KERNEL_4a_ARRAY "smart_blur_verticle_array"
+#define KERNEL_4b_ARRAY "smart_blur_horizontal_array"
+#define KERNEL_5_ARRAY "final_bloom_step_array"
 #define INPUT_FILE "bunnycity2.bmp"
+#define GREY_INPUT_FILE "bunnycity2_grey.bmp"
 #define OUTPUT_FILE "output.bmp"
 #define OUTPUT_FILE2 "output2.bmp"
 
+/* Set to 0 to keep the threshold and blur results in the frame format
+   instead of CL_HALF_FLOAT images. Devices without half images, and the
+   buffer backend, always use the frame format */
+#define HALF_INTERMEDIATES 1
+
+/* Copies of the input bloomed as one batch after the single frame, 0 skips
+   it. The batch always uses image arrays, whatever USE_BUFFERS is set to */
+#define BATCH_FRAMES 16
+
+/* Set to 1 to split a CPU device into sub-devices and bloom FISSION_JOBS
+   copies of the frame as independent jobs spread over them, against the
+   same jobs on the whole device. FISSION_UNITS compute units go to each
+   sub-device, 0 splits by NUMA affinity domain instead, or equally between
+   the jobs when there is only one domain */
+#define RUN_FISSION 1
+#define FISSION_UNITS 0
+#define FISSION_JOBS 32
+#define MAX_SUB_DEVICES 64
+
+/* Frames that do not fit in a quarter of the device memory, or are wider
+   than the image width limit, are bloomed in tiles of rows and columns with
+   a radius halo. Set to force strips of that many rows */
+#define STRIP_ROWS 0
+#define STRIP_MEMORY_FRACTION 4
+
+/* Device bytes per pixel of the whole frame path, two frames and three
+   intermediates of up to half4. The reduction only keeps one partial per
+   work-group, which does not grow with the frame */
+#define BYTES_PER_PIXEL (8 * CHANNELS)
+
+/* Set to 1 to reduce work-groups with sub-group reductions rather than
+   the work_group_reduce functions on devices that support both */
+#define PREFER_SUB_GROUPS 0
+
+/* A negative threshold blooms pixels at or above this fraction of the
+   frame's luminance histogram, 0 uses the average luminance instead */
+#define THRESHOLD_PERCENTILE 0.95f
+#define HISTOGRAM_BINS 256
+
+/* Work-groups per compute unit for the luminance reduction, each work-item
+   strides over the frame so this fixes the launch size, not the coverage */
+#define GROUPS_PER_UNIT 4
+
+/* Work-group edge length for the tiled blur kernels */
+#define TILE_SIZE 16
+
+/* Blur radii up to this are compiled in with -D RADIUS so the taps unroll */
+#define MAX_SPECIALIZED_RADIUS 8
+
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,8 +125,9 @@ cl_device_id create_device() {
 	return dev;
 }
 
-/* Create program from a file and compile it */
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename) {
+/* Create program from a file and compile it, options may be NULL */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename,
+	const char* options = NULL) {
 
 	cl_program program;
 	FILE *program_handle;
@@ -84,7 +159,7 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
 	free(program_buffer);
 
 	/* Build program */
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	err = clBuildProgram(program, 0, NULL, options, NULL, NULL);
 	if (err < 0) {
 
 		/* Find size of log and print to std output */
@@ -103,6 +178,843 @@ cl_program build_program(cl_context ctx, cl_device_id dev, const char* filename)
 	return program;
 }
 
+/* Normalized 1D Gaussian weights for the taps -radius..radius */
+float* gaussian_weights(int radius, float sigma) {
+	int dim = 2 * radius + 1;
+	float* weights = (float*)malloc(sizeof(float) * dim);
+	double total = 0;
+
+	for (int i = 0; i < dim; i++) {
+		double x = i - radius;
+		weights[i] = (float)exp(-(x * x) / (2.0 * sigma * sigma));
+		total += weights[i];
+	}
+	for (int i = 0; i < dim; i++)
+		weights[i] = (float)(weights[i] / total);
+
+	return weights;
+}
+
+/* Create a width x height frame, an image or a uchar4 buffer depending on USE_BUFFERS */
+cl_mem create_frame(cl_context ctx, cl_mem_flags flags, const cl_image_format* format,
+	size_t width, size_t height, void* pixels, cl_int* err) {
+#if USE_BUFFERS
+	return clCreateBuffer(ctx, flags, CHANNELS * width * height, pixels, err);
+#else
+	return clCreateImage2D(ctx, flags, format, width, height, 0, pixels, err);
+#endif
+}
+
+/* Blocking read of a whole frame created by create_frame */
+cl_int read_frame(cl_command_queue queue, cl_mem frame, size_t width, size_t height, void* pixels) {
+#if USE_BUFFERS
+	return clEnqueueReadBuffer(queue, frame, CL_TRUE, 0,
+		CHANNELS * width * height, pixels, 0, NULL, NULL);
+#else
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, 1 };
+
+	return clEnqueueReadImage(queue, frame, CL_TRUE, origin,
+		region, 0, 0, pixels, 0, NULL, NULL);
+#endif
+}
+
+/* Blocking write of a whole frame created by create_frame */
+cl_int write_frame(cl_command_queue queue, cl_mem frame, size_t width, size_t height, const void* pixels) {
+#if USE_BUFFERS
+	return clEnqueueWriteBuffer(queue, frame, CL_TRUE, 0,
+		CHANNELS * width * height, pixels, 0, NULL, NULL);
+#else
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, 1 };
+
+	return clEnqueueWriteImage(queue, frame, CL_TRUE, origin,
+		region, 0, 0, pixels, 0, NULL, NULL);
+#endif
+}
+
+/* True if the context can read and write CL_HALF_FLOAT images with the given channel order */
+bool half_images_supported(cl_context ctx, cl_channel_order order) {
+	cl_image_format* formats;
+	cl_uint num_formats;
+	bool found = false;
+
+	clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+		0, NULL, &num_formats);
+	formats = (cl_image_format*)malloc(sizeof(cl_image_format) * num_formats);
+	clGetSupportedImageFormats(ctx, CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D,
+		num_formats, formats, NULL);
+	for (cl_uint i = 0; i < num_formats; i++) {
+		if (formats[i].image_channel_order == order &&
+			formats[i].image_channel_data_type == CL_HALF_FLOAT)
+			found = true;
+	}
+
+	free(formats);
+	return found;
+}
+
+/*
+ * Create a frame for a stage result that never leaves the device, a half
+ * precision image when HALF_INTERMEDIATES is set and supported, otherwise
+ * the same format as the input frame.
+ */
+cl_mem create_intermediate(cl_context ctx, const cl_image_format* format,
+	size_t width, size_t height, cl_int* err) {
+#if HALF_INTERMEDIATES && !USE_BUFFERS
+	if (half_images_supported(ctx, format->image_channel_order)) {
+		cl_image_format half_format;
+		half_format.image_channel_order = format->image_channel_order;
+		half_format.image_channel_data_type = CL_HALF_FLOAT;
+		return clCreateImage2D(ctx, CL_MEM_READ_WRITE, &half_format, width, height, 0, NULL, err);
+	}
+#endif
+	return create_frame(ctx, CL_MEM_READ_WRITE, format, width, height, NULL, err);
+}
+
+/* Create an image array of layers frames, exiting if the device can't allocate it */
+cl_mem create_image_array(cl_context ctx, cl_mem_flags flags, const cl_image_format* format,
+	size_t width, size_t height, size_t layers) {
+	cl_image_desc desc;
+	cl_mem array;
+	cl_int err;
+
+	memset(&desc, 0, sizeof(desc));
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D_ARRAY;
+	desc.image_width = width;
+	desc.image_height = height;
+	desc.image_array_size = layers;
+
+	array = clCreateImage(ctx, flags, format, &desc, NULL, &err);
+	if (err < 0) {
+		printf("Couldn't create an image array of %d frames: %d\n", (int)layers, err);
+		exit(1);
+	}
+	return array;
+}
+
+/*
+ * Frames per bloom_batch launch. The batch holds five image arrays of
+ * frame_bytes per layer, so the layers are capped by the array size limit,
+ * by a single allocation and by 1/STRIP_MEMORY_FRACTION of the global
+ * memory for all five. Returns 0 when not even one frame fits.
+ */
+size_t batch_layers(cl_device_id dev, size_t frame_bytes) {
+	cl_ulong global_mem, max_alloc;
+	size_t layers;
+
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE_MAX_ARRAY_SIZE, sizeof(layers), &layers, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	if (layers > max_alloc / frame_bytes)
+		layers = (size_t)(max_alloc / frame_bytes);
+	if (layers > global_mem / STRIP_MEMORY_FRACTION / (5 * frame_bytes))
+		layers = (size_t)(global_mem / STRIP_MEMORY_FRACTION / (5 * frame_bytes));
+	return layers;
+}
+
+/*
+ * Bloom count frames packed back to back in frames with one launch per step
+ * for the whole batch, writing the results packed the same way to outputs.
+ * The threshold and filter are shared by the batch. count must not exceed
+ * batch_layers(). Returns the summed kernel time in
+ * nanoseconds.
+ */
+double bloom_batch(cl_context context, cl_command_queue queue, cl_program program,
+	const cl_image_format* format, size_t width, size_t height, const unsigned char* frames,
+	unsigned char* outputs, size_t count, cl_int dimension, cl_mem filter, float thres) {
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { width, height, count };
+	cl_kernel threshold, vertical, horizontal, composite;
+	cl_mem input, bright, blurred_v, blurred_h, output;
+	cl_event events[4];
+	cl_int err;
+	double time = 0;
+
+	threshold = clCreateKernel(program, KERNEL_3_ARRAY, &err);
+	vertical = clCreateKernel(program, KERNEL_4a_ARRAY, &err);
+	horizontal = clCreateKernel(program, KERNEL_4b_ARRAY, &err);
+	composite = clCreateKernel(program, KERNEL_5_ARRAY, &err);
+	if (err < 0) {
+		printf("Couldn't create a kernel: %d", err);
+		exit(1);
+	};
+
+	input = create_image_array(context, CL_MEM_READ_ONLY, format, width, height, count);
+	bright = create_image_array(context, CL_MEM_READ_WRITE, format, width, height, count);
+	blurred_v = create_image_array(context, CL_MEM_READ_WRITE, format, width, height, count);
+	blurred_h = create_image_array(context, CL_MEM_READ_WRITE, format, width, height, count);
+	output = create_image_array(context, CL_MEM_WRITE_ONLY, format, width, height, count);
+
+	err = clSetKernelArg(threshold, 0, sizeof(cl_mem), &input);
+	err |= clSetKernelArg(threshold, 1, sizeof(cl_mem), &bright);
+	err |= clSetKernelArg(threshold, 2, sizeof(float), &thres);
+	err |= clSetKernelArg(vertical, 0, sizeof(cl_mem), &bright);
+	err |= clSetKernelArg(vertical, 1, sizeof(cl_mem), &blurred_v);
+	err |= clSetKernelArg(vertical, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(vertical, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(horizontal, 0, sizeof(cl_mem), &blurred_v);
+	err |= clSetKernelArg(horizontal, 1, sizeof(cl_mem), &blurred_h);
+	err |= clSetKernelArg(horizontal, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(horizontal, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(composite, 0, sizeof(cl_mem), &input);
+	err |= clSetKernelArg(composite, 1, sizeof(cl_mem), &blurred_h);
+	err |= clSetKernelArg(composite, 2, sizeof(cl_mem), &output);
+	if (err < 0) {
+		perror("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueWriteImage(queue, input, CL_FALSE, origin, region, 0, 0,
+		frames, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(queue, threshold, 3, NULL, region, NULL, 0, NULL, &events[0]);
+	err |= clEnqueueNDRangeKernel(queue, vertical, 3, NULL, region, NULL, 0, NULL, &events[1]);
+	err |= clEnqueueNDRangeKernel(queue, horizontal, 3, NULL, region, NULL, 0, NULL, &events[2]);
+	err |= clEnqueueNDRangeKernel(queue, composite, 3, NULL, region, NULL, 0, NULL, &events[3]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+	err = clEnqueueReadImage(queue, output, CL_TRUE, origin, region, 0, 0,
+		outputs, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't read from the image object");
+		exit(1);
+	}
+
+	for (int i = 0; i < 4; i++) {
+		cl_ulong time_start, time_end;
+		clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+		clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+		time += (double)(time_end - time_start);
+		clReleaseEvent(events[i]);
+	}
+
+	clReleaseMemObject(input);
+	clReleaseMemObject(bright);
+	clReleaseMemObject(blurred_v);
+	clReleaseMemObject(blurred_h);
+	clReleaseMemObject(output);
+	clReleaseKernel(threshold);
+	clReleaseKernel(vertical);
+	clReleaseKernel(horizontal);
+	clReleaseKernel(composite);
+
+	return time;
+}
+
+/*
+ * Append the build options that pick how work-groups reduce: the
+ * work_group_reduce functions on OpenCL C 2.x devices and on 3.0 devices
+ * with __opencl_c_work_group_collective_functions, sub-group reductions
+ * with cl_khr_subgroups or cl_intel_subgroups, the local memory tree
+ * otherwise. PREFER_SUB_GROUPS
+ * picks sub-groups when a device has both. Returns the name of the choice.
+ */
+const char* reduction_options(cl_device_id dev, char* options) {
+	char version[64];
+	char* extensions;
+	size_t size;
+	bool work_groups, sub_groups, version_3 = false;
+
+	clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_VERSION, sizeof(version), version, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+	extensions = (char*)malloc(size);
+	clGetDeviceInfo(dev, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+	work_groups = strncmp(version, "OpenCL C 2.", 11) == 0;
+	sub_groups = strstr(extensions, "cl_khr_subgroups") != NULL ||
+		strstr(extensions, "cl_intel_subgroups") != NULL;
+	free(extensions);
+
+#ifdef CL_DEVICE_OPENCL_C_FEATURES
+	/* OpenCL C 3.0 makes the collectives optional, reported as a feature */
+	if (strncmp(version, "OpenCL C 3.", 11) == 0) {
+		cl_name_version* features;
+
+		clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_FEATURES, 0, NULL, &size);
+		features = (cl_name_version*)malloc(size);
+		clGetDeviceInfo(dev, CL_DEVICE_OPENCL_C_FEATURES, size, features, NULL);
+		for (size_t i = 0; i < size / sizeof(cl_name_version); i++) {
+			if (strcmp(features[i].name, "__opencl_c_work_group_collective_functions") == 0)
+				version_3 = true;
+		}
+		free(features);
+	}
+#endif
+
+	if (version_3) {
+		work_groups = true;
+		strcat(options, " -cl-std=CL3.0");
+	}
+	else if (work_groups)
+		strcat(options, " -cl-std=CL2.0");
+	if (sub_groups && (PREFER_SUB_GROUPS || !work_groups)) {
+		strcat(options, " -D SUB_GROUPS");
+		return "sub-group reductions";
+	}
+	if (work_groups) {
+		strcat(options, " -D WORK_GROUP_REDUCE");
+		return "work-group reductions";
+	}
+	return "local memory tree";
+}
+
+/* Luminance statistics on the 0-255 scale, matching lum_stats in the kernels.
+   m2 is the sum of squared differences from the mean */
+typedef struct {
+	cl_float min;
+	cl_float max;
+	cl_uint count;
+	cl_float mean;
+	cl_float m2;
+} LumStats;
+
+/* Largest per-channel difference between two frames, ignoring alpha in RGBA frames */
+int max_difference(const unsigned char* a, const unsigned char* b, size_t size, int channels) {
+	int max_diff = 0;
+
+	for (size_t i = 0; i < size * channels; i++) {
+		if (channels == 4 && i % 4 == 3)
+			continue;
+		int diff = abs(a[i] - b[i]);
+		if (diff > max_diff)
+			max_diff = diff;
+	}
+
+	return max_diff;
+}
+
+/* Average luminance of a frame on the host, on the same 0-255 scale as the reduction */
+double avg_lum(const unsigned char* image, size_t size) {
+	double avg = 0;
+#if GREYSCALE
+	for (size_t i = 0; i < size; i++) {
+		avg += image[i];
+	}
+#else
+	for (size_t i = 0; i < size * 4; i += 4) {
+		avg += ((image[i + 0] * 0.299) + (image[i + 1] * 0.587) + (image[i + 2] * 0.114));
+	}
+#endif
+	avg /= size;
+	return avg;
+}
+
+/* Luminance at fraction of a frame's pixels on the host, binned as on the device */
+float percentile_lum(const unsigned char* image, size_t size, float fraction) {
+	size_t bins[HISTOGRAM_BINS] = { 0 };
+	double lum, count = 0;
+
+	for (size_t i = 0; i < size; i++) {
+#if GREYSCALE
+		lum = image[i];
+#else
+		lum = (image[i * 4 + 0] * 0.299) + (image[i * 4 + 1] * 0.587) + (image[i * 4 + 2] * 0.114);
+#endif
+		int bin = (int)(lum * HISTOGRAM_BINS / 256.0);
+		bins[bin < HISTOGRAM_BINS ? bin : HISTOGRAM_BINS - 1]++;
+	}
+	for (int i = 0; i < HISTOGRAM_BINS; i++) {
+		count += bins[i];
+		if (count >= fraction * size)
+			return i * 256.0f / HISTOGRAM_BINS;
+	}
+	return 255.0f;
+}
+
+/*
+ * Luminance at fraction of the pixels counted in histogram, 0.5 for the
+ * median, found on the device by histogram_percentile in one work-group.
+ */
+float query_percentile(cl_command_queue queue, cl_kernel kernel, cl_mem histogram,
+	cl_mem result, size_t group_size, float fraction) {
+	float lum = 0;
+	cl_int err;
+
+	if (fraction <= 0)
+		return 0;
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &histogram);
+	err |= clSetKernelArg(kernel, 1, group_size * sizeof(cl_uint), NULL);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &result);
+	err |= clSetKernelArg(kernel, 3, sizeof(float), &fraction);
+	if (err < 0) {
+		perror("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &group_size,
+		&group_size, 0, NULL, NULL);
+	err |= clEnqueueReadBuffer(queue, result, CL_TRUE, 0,
+		sizeof(float), &lum, 0, NULL, NULL);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+	return lum;
+}
+
+/*
+ * Columns per tile so that a tile and its radius halo left and right fit
+ * the image width limit. Returns width when the whole frame fits, as it
+ * always does with buffers.
+ */
+size_t strip_columns(cl_device_id dev, size_t width, int radius) {
+	size_t max_width;
+
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(max_width), &max_width, NULL);
+	if (USE_BUFFERS || width <= max_width)
+		return width;
+	if (max_width <= 2 * (size_t)radius) {
+		printf("The image width limit is too small for a radius %d halo\n", radius);
+		exit(1);
+	}
+	return max_width - 2 * radius;
+}
+
+/*
+ * Rows per strip so that a strip of width pixels, halo included, and its
+ * radius halo above and below take no more than bytes_per_pixel per pixel
+ * out of 1/STRIP_MEMORY_FRACTION of the global memory, and fit a single
+ * allocation and the image height limit. Returns height when the whole
+ * frame fits.
+ */
+size_t strip_rows(cl_device_id dev, size_t width, size_t height, int radius, size_t bytes_per_pixel) {
+	cl_ulong global_mem, max_alloc;
+	size_t max_height, rows;
+
+	clGetDeviceInfo(dev, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_HEIGHT, sizeof(max_height), &max_height, NULL);
+#if USE_BUFFERS
+	max_height = height;
+#endif
+
+	rows = (size_t)(global_mem / STRIP_MEMORY_FRACTION / (bytes_per_pixel * width));
+	if (rows > max_alloc / (sizeof(cl_float4) * width))
+		rows = (size_t)(max_alloc / (sizeof(cl_float4) * width));
+	if (rows >= height && height <= max_height)
+		return height;
+	if (rows > max_height)
+		rows = max_height;
+	if (rows <= 2 * (size_t)radius) {
+		printf("Not enough device memory for a strip with a radius %d halo\n", radius);
+		exit(1);
+	}
+	return rows - 2 * radius;
+}
+
+/* Coordinate v clamped to a frame side of size pixels */
+size_t clamp_coordinate(long long v, size_t size) {
+	if (v < 0)
+		return 0;
+	if (v > (long long)size - 1)
+		return size - 1;
+	return (size_t)v;
+}
+
+/*
+ * Copy a tile_width by tile_height tile starting x_halo columns left of x0
+ * and y_halo rows above y0 from a width by height frame into tile, pixels
+ * past the frame edges repeating the edge pixel the way clamp to edge does
+ * on the whole frame.
+ */
+void gather_tile(const unsigned char* input, unsigned char* tile, size_t width, size_t height,
+	size_t x0, size_t y0, size_t tile_width, size_t tile_height, int x_halo, int y_halo) {
+	for (size_t i = 0; i < tile_height; i++) {
+		const unsigned char* row = input +
+			clamp_coordinate((long long)(y0 + i) - y_halo, height) * width * CHANNELS;
+		unsigned char* dst = tile + i * tile_width * CHANNELS;
+
+		for (size_t j = 0; j < tile_width;) {
+			long long x = (long long)(x0 + j) - x_halo;
+			if (x < 0 || x >= (long long)width) {
+				memcpy(dst + j * CHANNELS, row + clamp_coordinate(x, width) * CHANNELS, CHANNELS);
+				j++;
+			}
+			else {
+				/* Copy the run inside the frame in one go */
+				size_t run = width - (size_t)x < tile_width - j ? width - (size_t)x : tile_width - j;
+				memcpy(dst + j * CHANNELS, row + (size_t)x * CHANNELS, run * CHANNELS);
+				j += run;
+			}
+		}
+	}
+}
+
+/*
+ * Bloom a frame tile by tile, columns by rows pixels at a time. Tiles
+ * narrower or shorter than the frame carry a radius halo on those sides,
+ * pixels past the frame edges repeating the edge pixel the way clamp to
+ * edge does on the whole frame, so the stitched output matches blooming the
+ * whole frame in one go. Only one tile of each frame is on the device at a
+ * time. Returns the summed kernel time in nanoseconds.
+ */
+double bloom_strips(cl_context context, cl_command_queue queue, cl_kernel threshold,
+	cl_kernel vertical, cl_kernel horizontal, cl_kernel composite, const cl_image_format* format,
+	size_t width, size_t height, size_t columns, size_t rows, int radius, size_t tile_size,
+	cl_mem filter, float thres, const unsigned char* input, unsigned char* output) {
+	int x_halo = columns < width ? radius : 0, y_halo = rows < height ? radius : 0;
+	size_t strip_width = columns + 2 * x_halo, strip_height = rows + 2 * y_halo;
+	size_t global_size[2] = { strip_width, strip_height };
+	size_t tile_local[2] = { tile_size, tile_size };
+	size_t tile_global[2] = { (strip_width + tile_size - 1) / tile_size * tile_size,
+		(strip_height + tile_size - 1) / tile_size * tile_size };
+	cl_int dimension = 2 * radius + 1;
+#if USE_BUFFERS
+	cl_int w = (cl_int)strip_width, h = (cl_int)strip_height;
+#endif
+	unsigned char* strip_in = (unsigned char*)malloc(strip_width * strip_height * CHANNELS);
+	unsigned char* strip_out = (unsigned char*)malloc(strip_width * strip_height * CHANNELS);
+	cl_mem input_frame, bright, blurred_v, blurred_h, output_frame;
+	cl_event events[4];
+	cl_int err;
+	double time = 0;
+
+	input_frame = create_frame(context, CL_MEM_READ_ONLY, format, strip_width, strip_height, NULL, &err);
+	output_frame = create_frame(context, CL_MEM_WRITE_ONLY, format, strip_width, strip_height, NULL, &err);
+	bright = create_intermediate(context, format, strip_width, strip_height, &err);
+	blurred_v = create_intermediate(context, format, strip_width, strip_height, &err);
+	blurred_h = create_intermediate(context, format, strip_width, strip_height, &err);
+	if (err < 0) {
+		perror("Couldn't create the image object");
+		exit(1);
+	};
+
+	err = clSetKernelArg(threshold, 0, sizeof(cl_mem), &input_frame);
+	err |= clSetKernelArg(threshold, 1, sizeof(cl_mem), &bright);
+	err |= clSetKernelArg(threshold, 2, sizeof(float), &thres);
+	err |= clSetKernelArg(vertical, 0, sizeof(cl_mem), &bright);
+	err |= clSetKernelArg(vertical, 1, sizeof(cl_mem), &blurred_v);
+	err |= clSetKernelArg(vertical, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(vertical, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(horizontal, 0, sizeof(cl_mem), &blurred_v);
+	err |= clSetKernelArg(horizontal, 1, sizeof(cl_mem), &blurred_h);
+	err |= clSetKernelArg(horizontal, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(horizontal, 3, sizeof(cl_mem), &filter);
+	err |= clSetKernelArg(composite, 0, sizeof(cl_mem), &input_frame);
+	err |= clSetKernelArg(composite, 1, sizeof(cl_mem), &blurred_h);
+	err |= clSetKernelArg(composite, 2, sizeof(cl_mem), &output_frame);
+#if USE_BUFFERS
+	err |= clSetKernelArg(threshold, 3, sizeof(cl_int), &w);
+	err |= clSetKernelArg(vertical, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(vertical, 5, sizeof(cl_int), &h);
+	err |= clSetKernelArg(horizontal, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(horizontal, 5, sizeof(cl_int), &h);
+	err |= clSetKernelArg(composite, 3, sizeof(cl_int), &w);
+#else
+	err |= clSetKernelArg(vertical, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+	err |= clSetKernelArg(horizontal, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+#endif
+	if (err < 0) {
+		perror("Couldn't set a kernel argument");
+		exit(1);
+	};
+
+	for (size_t y0 = 0; y0 < height; y0 += rows) {
+		size_t count = height - y0 < rows ? height - y0 : rows;
+
+		for (size_t x0 = 0; x0 < width; x0 += columns) {
+			size_t span = width - x0 < columns ? width - x0 : columns;
+
+			/* Gather the tile and its halo, clamping source pixels to the frame */
+			gather_tile(input, strip_in, width, height, x0, y0, strip_width, strip_height, x_halo, y_halo);
+
+			err = write_frame(queue, input_frame, strip_width, strip_height, strip_in);
+			err |= clEnqueueNDRangeKernel(queue, threshold, 2, NULL, global_size, NULL, 0, NULL, &events[0]);
+			err |= clEnqueueNDRangeKernel(queue, vertical, 2, NULL, tile_global, tile_local, 0, NULL, &events[1]);
+			err |= clEnqueueNDRangeKernel(queue, horizontal, 2, NULL, tile_global, tile_local, 0, NULL, &events[2]);
+			err |= clEnqueueNDRangeKernel(queue, composite, 2, NULL, global_size, NULL, 0, NULL, &events[3]);
+			if (err < 0) {
+				perror("Couldn't enqueue the kernel");
+				exit(1);
+			}
+			err = read_frame(queue, output_frame, strip_width, strip_height, strip_out);
+			if (err < 0) {
+				perror("Couldn't read from the image object");
+				exit(1);
+			}
+
+			/* Keep the pixels clear of the halo */
+			for (size_t i = 0; i < count; i++)
+				memcpy(output + ((y0 + i) * width + x0) * CHANNELS,
+					strip_out + ((y_halo + i) * strip_width + x_halo) * CHANNELS, span * CHANNELS);
+
+			for (int i = 0; i < 4; i++) {
+				cl_ulong time_start, time_end;
+				clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START, sizeof(time_start), &time_start, NULL);
+				clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END, sizeof(time_end), &time_end, NULL);
+				time += (double)(time_end - time_start);
+				clReleaseEvent(events[i]);
+			}
+		}
+	}
+
+	free(strip_in);
+	free(strip_out);
+	clReleaseMemObject(input_frame);
+	clReleaseMemObject(output_frame);
+	clReleaseMemObject(bright);
+	clReleaseMemObject(blurred_v);
+	clReleaseMemObject(blurred_h);
+
+	return time;
+}
+
+/* Partition a device with props, returns how many sub-devices were created,
+   0 if it cannot be partitioned that way or would give more than max */
+cl_uint partition_device(cl_device_id dev, const cl_device_partition_property* props,
+	cl_device_id* subs, cl_uint max) {
+	cl_uint count;
+	cl_int err;
+
+	err = clCreateSubDevices(dev, props, 0, NULL, &count);
+	if (err < 0 || count > max)
+		return 0;
+	err = clCreateSubDevices(dev, props, count, subs, NULL);
+	if (err < 0)
+		return 0;
+
+	return count;
+}
+
+/*
+ * Partition a device into sub-devices, by NUMA affinity domain when units
+ * is 0, otherwise equally with units compute units each. A single NUMA
+ * domain gives nothing to spread jobs over, so the compute units are then
+ * shared equally between up to jobs sub-devices instead. Returns how many
+ * were created, 0 if the device cannot be split in two or more within max.
+ */
+cl_uint create_sub_devices(cl_device_id dev, cl_uint units, cl_uint jobs, cl_device_id* subs, cl_uint max) {
+	cl_device_partition_property props[3];
+	cl_uint count, compute_units;
+
+	props[2] = 0;
+	if (units == 0) {
+		props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+		count = partition_device(dev, props, subs, max);
+		if (count >= 2)
+			return count;
+		if (count == 1)
+			clReleaseDevice(subs[0]);
+
+		clGetDeviceInfo(dev, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+		if (jobs > max)
+			jobs = max;
+		units = (compute_units + jobs - 1) / jobs;
+		if (units == 0 || compute_units / units < 2)
+			units = compute_units / 2;
+		if (units == 0)
+			return 0;
+	}
+
+	props[0] = CL_DEVICE_PARTITION_EQUALLY;
+	props[1] = units;
+	return partition_device(dev, props, subs, max);
+}
+
+/*
+ * A device bloom jobs are handed to, with its own context, queue and
+ * program and a frame for every stage, so jobs given to different devices
+ * run at the same time.
+ */
+typedef struct {
+	cl_context context;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel threshold, vertical, horizontal, composite;
+	cl_mem filter, input, bright, blurred_v, blurred_h, output;
+	cl_event pending[2];
+	size_t width, height, tile_size;
+} BloomDevice;
+
+/* Set up dev for blooming width x height frames with the program built with
+   options, the blur weights and threshold shared by every job */
+void create_bloom_device(BloomDevice* bloom, cl_device_id dev, const char* options,
+	const cl_image_format* format, size_t width, size_t height, size_t tile_size,
+	const float* weights, int radius, float thres) {
+	cl_int dimension = 2 * radius + 1;
+#if USE_BUFFERS
+	cl_int w = (cl_int)width, h = (cl_int)height;
+#endif
+	cl_int err;
+
+	bloom->width = width;
+	bloom->height = height;
+	bloom->tile_size = tile_size;
+	bloom->context = clCreateContext(NULL, 1, &dev, NULL, NULL, &err);
+	if (err < 0) {
+		perror("Couldn't create a context");
+		exit(1);
+	}
+	bloom->queue = clCreateCommandQueue(bloom->context, dev, CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) {
+		perror("Couldn't create a command queue");
+		exit(1);
+	};
+
+	bloom->program = build_program(bloom->context, dev, PROGRAM_FILE, options);
+	bloom->threshold = clCreateKernel(bloom->program, KERNEL_3, &err);
+	bloom->vertical = clCreateKernel(bloom->program, KERNEL_4a, &err);
+	bloom->horizontal = clCreateKernel(bloom->program, KERNEL_4b, &err);
+	bloom->composite = clCreateKernel(bloom->program, KERNEL_5, &err);
+	if (err < 0) {
+		printf("Couldn't create a kernel: %d\n", err);
+		exit(1);
+	};
+
+	bloom->filter = clCreateBuffer(bloom->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * dimension, (void*)weights, &err);
+	if (err < 0) {
+		perror("Couldn't create a buffer");
+		exit(1);
+	};
+	bloom->input = create_frame(bloom->context, CL_MEM_READ_ONLY, format, width, height, NULL, &err);
+	bloom->output = create_frame(bloom->context, CL_MEM_WRITE_ONLY, format, width, height, NULL, &err);
+	bloom->bright = create_intermediate(bloom->context, format, width, height, &err);
+	bloom->blurred_v = create_intermediate(bloom->context, format, width, height, &err);
+	bloom->blurred_h = create_intermediate(bloom->context, format, width, height, &err);
+	if (err < 0) {
+		perror("Couldn't create the image object");
+		exit(1);
+	};
+
+	err = clSetKernelArg(bloom->threshold, 0, sizeof(cl_mem), &bloom->input);
+	err |= clSetKernelArg(bloom->threshold, 1, sizeof(cl_mem), &bloom->bright);
+	err |= clSetKernelArg(bloom->threshold, 2, sizeof(float), &thres);
+	err |= clSetKernelArg(bloom->vertical, 0, sizeof(cl_mem), &bloom->bright);
+	err |= clSetKernelArg(bloom->vertical, 1, sizeof(cl_mem), &bloom->blurred_v);
+	err |= clSetKernelArg(bloom->vertical, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(bloom->vertical, 3, sizeof(cl_mem), &bloom->filter);
+	err |= clSetKernelArg(bloom->horizontal, 0, sizeof(cl_mem), &bloom->blurred_v);
+	err |= clSetKernelArg(bloom->horizontal, 1, sizeof(cl_mem), &bloom->blurred_h);
+	err |= clSetKernelArg(bloom->horizontal, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(bloom->horizontal, 3, sizeof(cl_mem), &bloom->filter);
+	err |= clSetKernelArg(bloom->composite, 0, sizeof(cl_mem), &bloom->input);
+	err |= clSetKernelArg(bloom->composite, 1, sizeof(cl_mem), &bloom->blurred_h);
+	err |= clSetKernelArg(bloom->composite, 2, sizeof(cl_mem), &bloom->output);
+#if USE_BUFFERS
+	err |= clSetKernelArg(bloom->threshold, 3, sizeof(cl_int), &w);
+	err |= clSetKernelArg(bloom->vertical, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(bloom->vertical, 5, sizeof(cl_int), &h);
+	err |= clSetKernelArg(bloom->horizontal, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(bloom->horizontal, 5, sizeof(cl_int), &h);
+	err |= clSetKernelArg(bloom->composite, 3, sizeof(cl_int), &w);
+#else
+	err |= clSetKernelArg(bloom->vertical, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+	err |= clSetKernelArg(bloom->horizontal, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+#endif
+	if (err < 0) {
+		perror("Couldn't set a kernel argument");
+		exit(1);
+	};
+}
+
+void release_bloom_device(BloomDevice* bloom) {
+	clReleaseMemObject(bloom->filter);
+	clReleaseMemObject(bloom->input);
+	clReleaseMemObject(bloom->bright);
+	clReleaseMemObject(bloom->blurred_v);
+	clReleaseMemObject(bloom->blurred_h);
+	clReleaseMemObject(bloom->output);
+	clReleaseKernel(bloom->threshold);
+	clReleaseKernel(bloom->vertical);
+	clReleaseKernel(bloom->horizontal);
+	clReleaseKernel(bloom->composite);
+	clReleaseCommandQueue(bloom->queue);
+	clReleaseProgram(bloom->program);
+	clReleaseContext(bloom->context);
+}
+
+/* Enqueue the bloom of input into output and return without waiting for it */
+void start_bloom(BloomDevice* bloom, const unsigned char* input, unsigned char* output) {
+	size_t global_size[2] = { bloom->width, bloom->height };
+	size_t tile_local[2] = { bloom->tile_size, bloom->tile_size };
+	size_t tile_global[2] = { (bloom->width + bloom->tile_size - 1) / bloom->tile_size * bloom->tile_size,
+		(bloom->height + bloom->tile_size - 1) / bloom->tile_size * bloom->tile_size };
+#if USE_BUFFERS
+	size_t frame_bytes = CHANNELS * bloom->width * bloom->height;
+#else
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3] = { bloom->width, bloom->height, 1 };
+#endif
+	cl_int err;
+
+#if USE_BUFFERS
+	err = clEnqueueWriteBuffer(bloom->queue, bloom->input, CL_FALSE, 0, frame_bytes,
+		input, 0, NULL, NULL);
+#else
+	err = clEnqueueWriteImage(bloom->queue, bloom->input, CL_FALSE, origin, region, 0, 0,
+		input, 0, NULL, NULL);
+#endif
+	err |= clEnqueueNDRangeKernel(bloom->queue, bloom->threshold, 2, NULL, global_size,
+		NULL, 0, NULL, &bloom->pending[0]);
+	err |= clEnqueueNDRangeKernel(bloom->queue, bloom->vertical, 2, NULL, tile_global,
+		tile_local, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(bloom->queue, bloom->horizontal, 2, NULL, tile_global,
+		tile_local, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(bloom->queue, bloom->composite, 2, NULL, global_size,
+		NULL, 0, NULL, &bloom->pending[1]);
+	if (err < 0) {
+		perror("Couldn't enqueue the kernel");
+		exit(1);
+	}
+
+#if USE_BUFFERS
+	err = clEnqueueReadBuffer(bloom->queue, bloom->output, CL_FALSE, 0, frame_bytes,
+		output, 0, NULL, NULL);
+#else
+	err = clEnqueueReadImage(bloom->queue, bloom->output, CL_FALSE, origin, region, 0, 0,
+		output, 0, NULL, NULL);
+#endif
+	if (err < 0) {
+		perror("Couldn't read from the image object");
+		exit(1);
+	}
+	clFlush(bloom->queue);
+}
+
+/* Wait for the bloom start_bloom enqueued, start and end receive the device
+   timestamps of its first and last kernel */
+void finish_bloom(BloomDevice* bloom, cl_ulong* start, cl_ulong* end) {
+	clFinish(bloom->queue);
+	clGetEventProfilingInfo(bloom->pending[0], CL_PROFILING_COMMAND_START, sizeof(*start), start, NULL);
+	clGetEventProfilingInfo(bloom->pending[1], CL_PROFILING_COMMAND_END, sizeof(*end), end, NULL);
+	clReleaseEvent(bloom->pending[0]);
+	clReleaseEvent(bloom->pending[1]);
+}
+
+/*
+ * Bloom jobs copies of a frame as independent jobs handed out in turn to
+ * the devices, so up to count jobs run at once, job i of each round writing
+ * the ith frame of output. Returns the device time from the first kernel
+ * start to the last kernel end in nanoseconds, all devices must share one
+ * clock.
+ */
+double bloom_jobs(BloomDevice* blooms, int count, const unsigned char* input,
+	unsigned char* output, int jobs) {
+	cl_ulong first_start = 0, last_end = 0;
+
+	for (int job = 0; job < jobs; job += count) {
+		int n = jobs - job < count ? jobs - job : count;
+
+		for (int i = 0; i < n; i++)
+			start_bloom(&blooms[i], input, output + (size_t)i * blooms[i].width * blooms[i].height * CHANNELS);
+		for (int i = 0; i < n; i++) {
+			cl_ulong start, end;
+
+			finish_bloom(&blooms[i], &start, &end);
+			if (first_start == 0 || start < first_start)
+				first_start = start;
+			if (end > last_end)
+				last_end = end;
+		}
+	}
+
+	return (double)(last_end - first_start);
+}
+
 int main(int argc, char **argv) {
 
 	/* Host/device data structures */
@@ -110,43 +1022,64 @@ int main(int argc, char **argv) {
 	cl_context context;
 	cl_command_queue queue;
 	cl_program program;
-	cl_kernel kernel, vector_kernel, complete_kernel, kernel4a, kernel4b, kernel5, transform_kernel;
+	cl_kernel kernel, complete_kernel, kernel4a, kernel4b, kernel5, luminance_kernel;
+	cl_kernel histogram_kernel, percentile_kernel;
 	cl_int err;
-	size_t global_size[2], loc_size, glob_size;
+	size_t global_size[2], loc_size, glob_size, groups;
+	cl_uint compute_units;
+	size_t tile_size, tile_local[2], tile_global[2], strip, columns;
+	size_t tile_group, tile_group_b;
 
 	/* Image data */
 	unsigned char* inputImage;
 	unsigned char* outputImage;
 
 	cl_image_format img_format;
-	cl_mem input_image, input_image2, output_image, image_data;
-	size_t origin[3], region[3];
+	cl_mem input_image, output_image;
+	cl_mem bright_image, vertical_image, blurred_image;
 	size_t width, height;
 	int w, h;
-	int dimension;
+	int dimension, radius;
+	float sigma;
 	float thres;
+	float* weights;
+	cl_ulong local_mem_size;
 
 
 
-	std::cout << "Please enter 3, 5 or 7: ";
-	std::cin >> dimension;
+	std::cout << "Please enter the blur radius: ";
+	std::cin >> radius;
 	std::cin.ignore(100, '\n');
-	//If you won't play by the rules, you can't play
-	if (dimension != 3 && dimension != 5 && dimension != 7) {
-		dimension = 3;
+	if (radius < 1) {
+		radius = 1;
 	}
+	std::cout << "Please enter sigma (0 for radius / 3): ";
+	std::cin >> sigma;
+	std::cin.ignore(100, '\n');
+	//Three sigma either side covers 99.7% of the curve
+	if (sigma <= 0) {
+		sigma = radius / 3.0f;
+		if (sigma < 1.0f)
+			sigma = 1.0f;
+	}
+	dimension = 2 * radius + 1;
+	weights = gaussian_weights(radius, sigma);
 
 	/* Open input file and read image data */
+#if GREYSCALE
+	inputImage = readGreyscaleImage(GREY_INPUT_FILE, &w, &h);
+#else
 	inputImage = readRGBImage(INPUT_FILE, &w, &h);
+#endif
 	width = w;
 	height = h;
 	//outputinput = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
-	outputImage = (unsigned char*)malloc(sizeof(unsigned char)*w*h * 4);
+	outputImage = (unsigned char*)malloc(sizeof(unsigned char)*width*height * CHANNELS);
 
 	/* Data and buffers */
-	float *data = new float[w*h];
-	float sum;
-	cl_mem data_buffer, sum_buffer;
+	LumStats stats;
+	cl_mem partial_buffer, stats_buffer, filter_buffer;
+	cl_mem histogram_buffer, percentile_buffer;
 
 	/* Create a device and context */
 	device = create_device();
@@ -158,10 +1091,18 @@ int main(int argc, char **argv) {
 	}
 
 	/* Build the program and create a kernel */
-	program = build_program(context, device, PROGRAM_FILE);
-	vector_kernel = clCreateKernel(program, KERNEL_1, &err);
+	char options[128] = "";
+	if (radius <= MAX_SPECIALIZED_RADIUS)
+		sprintf(options, "-D RADIUS=%d", radius);
+	if (GREYSCALE)
+		strcat(options, " -D GREYSCALE");
+	printf("Work-groups reduce with %s\n", reduction_options(device, options));
+	sprintf(options + strlen(options), " -D HISTOGRAM_BINS=%d", HISTOGRAM_BINS);
+	program = build_program(context, device, PROGRAM_FILE, options);
 	complete_kernel = clCreateKernel(program, KERNEL_2, &err);
-	transform_kernel = clCreateKernel(program, KERNEL_T, &err);
+	luminance_kernel = clCreateKernel(program, KERNEL_T, &err);
+	histogram_kernel = clCreateKernel(program, KERNEL_HIST, &err);
+	percentile_kernel = clCreateKernel(program, KERNEL_PERCENTILE, &err);
 	kernel = clCreateKernel(program, KERNEL_3, &err);
 	kernel4a = clCreateKernel(program, KERNEL_4a, &err);
 	kernel4b = clCreateKernel(program, KERNEL_4b, &err);
@@ -171,118 +1112,225 @@ int main(int argc, char **argv) {
 		exit(1);
 	};
 
+	err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+		sizeof(loc_size), &loc_size, NULL);
+
+	/* Square work-groups for the tiled blur, global size rounded up to fit, */
+	/* within the limit of both tiled kernels (the device limit if the query */
+	/* fails) and small enough that the tile plus its halo fits in local memory */
+	tile_group = loc_size;
+	if (clGetKernelWorkGroupInfo(kernel4a, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(tile_group_b), &tile_group_b, NULL) == CL_SUCCESS && tile_group_b < tile_group)
+		tile_group = tile_group_b;
+	if (clGetKernelWorkGroupInfo(kernel4b, device, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(tile_group_b), &tile_group_b, NULL) == CL_SUCCESS && tile_group_b < tile_group)
+		tile_group = tile_group_b;
+	clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+		sizeof(local_mem_size), &local_mem_size, NULL);
+	tile_size = TILE_SIZE;
+	while (tile_size > 1 && (tile_size * tile_size > tile_group ||
+		sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size > local_mem_size))
+		tile_size /= 2;
+	tile_local[0] = tile_size; tile_local[1] = tile_size;
+	tile_global[0] = (width + tile_size - 1) / tile_size * tile_size;
+	tile_global[1] = (height + tile_size - 1) / tile_size * tile_size;
+
+	/* Create a command queue */
+	queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) {
+		perror("Couldn't create a command queue");
+		exit(1);
+	};
+
 	/* Create image object */
-	img_format.image_channel_order = CL_RGBA;
+	img_format.image_channel_order = GREYSCALE ? CL_R : CL_RGBA;
 	img_format.image_channel_data_type = CL_UNORM_INT8;
 
-	sum_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-		sizeof(float), NULL, &err);
-	input_image = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)inputImage, &err);
-	output_image = clCreateImage2D(context,
-		CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
+	filter_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(float) * dimension, weights, &err);
+
+	/* Frames too large for the device are bloomed tile by tile, with the
+	   average luminance for the threshold found on the host */
+	columns = strip_columns(device, width, radius);
+	strip = STRIP_ROWS > 0 ? STRIP_ROWS : strip_rows(device,
+		columns < width ? columns + 2 * radius : width, height, radius, BYTES_PER_PIXEL);
+	if (strip < height || columns < width) {
+		std::cout << "Threshold: ";
+		std::cin >> thres;
+		std::cin.ignore(100, '\n');
+		if (thres < 0 && THRESHOLD_PERCENTILE > 0)
+			thres = percentile_lum(inputImage, width * height, THRESHOLD_PERCENTILE);
+		else if (thres < 0)
+			thres = (float)avg_lum(inputImage, width * height);
+
+		double strip_time = bloom_strips(context, queue, kernel, kernel4a, kernel4b, kernel5,
+			&img_format, width, height, columns, strip, radius, tile_size, filter_buffer, thres,
+			inputImage, outputImage);
+		printf("Bloomed %d tiles of %d by %d pixels in %0.3f milliseconds\n",
+			(int)(((width + columns - 1) / columns) * ((height + strip - 1) / strip)),
+			(int)columns, (int)strip, strip_time / 1000000.0);
+#if GREYSCALE
+		storeGreyscaleImage(outputImage, OUTPUT_FILE, h, w, GREY_INPUT_FILE);
+#else
+		storeRGBImage(outputImage, OUTPUT_FILE, h, w, INPUT_FILE);
+#endif
+		getchar();
+
+		free(inputImage);
+		free(outputImage);
+		free(weights);
+		clReleaseMemObject(filter_buffer);
+		clReleaseKernel(complete_kernel);
+		clReleaseKernel(kernel);
+		clReleaseKernel(luminance_kernel);
+		clReleaseKernel(histogram_kernel);
+		clReleaseKernel(percentile_kernel);
+		clReleaseKernel(kernel4a);
+		clReleaseKernel(kernel4b);
+		clReleaseKernel(kernel5);
+		clReleaseCommandQueue(queue);
+		clReleaseProgram(program);
+		clReleaseContext(context);
+		return 0;
+	}
+
+	stats_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+		sizeof(LumStats), NULL, &err);
+	input_image = create_frame(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		&img_format, width, height, (void*)inputImage, &err);
+	output_image = create_frame(context, CL_MEM_WRITE_ONLY,
+		&img_format, width, height, NULL, &err);
 	if (err < 0) {
 		perror("Couldn't create the image object");
 		exit(1);
 	};
 
-	err = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
-		sizeof(loc_size), &loc_size, NULL);
-
-	/* Create a command queue */
-	queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+	/* Threshold and blur results stay on the device until the final composite */
+	bright_image = create_intermediate(context, &img_format, width, height, &err);
+	vertical_image = create_intermediate(context, &img_format, width, height, &err);
+	blurred_image = create_intermediate(context, &img_format, width, height, &err);
 	if (err < 0) {
-		perror("Couldn't create a command queue");
+		perror("Couldn't create the image object");
 		exit(1);
 	};
+#if HALF_INTERMEDIATES && !USE_BUFFERS
+	if (!half_images_supported(context, img_format.image_channel_order))
+		printf("Half precision images are not supported, intermediates stay 8-bit\n");
+#endif
 
-	input_image = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)inputImage, &err);
-	image_data = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
-		sizeof(float)*w*h, NULL, &err);
+	/* Luminance and the first reduction stage run as one launch of a fixed
+	   number of work-groups, no more than the frame needs, each writing the
+	   min, max, count, mean and m2 of its pixels as one LumStats. A single
+	   work-group then combines the partials */
+	clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
+		sizeof(compute_units), &compute_units, NULL);
+	while (loc_size & (loc_size - 1))
+		loc_size &= loc_size - 1;
+	groups = compute_units * GROUPS_PER_UNIT;
+	if (groups > (width*height + loc_size - 1) / loc_size)
+		groups = (width*height + loc_size - 1) / loc_size;
+	glob_size = groups * loc_size;
+	partial_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE,
+		groups * sizeof(LumStats), NULL, &err);
 	if (err < 0) {
 		perror("Couldn't create a buffer");
-		getchar();
 		exit(1);
 	};
 
-	err = clSetKernelArg(transform_kernel, 0, sizeof(cl_mem), &input_image);
-	err |= clSetKernelArg(transform_kernel, 1, sizeof(cl_mem), &image_data);
-	err |= clSetKernelArg(transform_kernel, 2, sizeof(cl_int), &h);
+	cl_int count = (cl_int)groups;
+	err = clSetKernelArg(luminance_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(luminance_kernel, 1, loc_size * sizeof(LumStats), NULL);
+	err |= clSetKernelArg(luminance_kernel, 2, sizeof(cl_mem), &partial_buffer);
+#if USE_BUFFERS
+	cl_int pixels = w * h;
+	err |= clSetKernelArg(luminance_kernel, 3, sizeof(cl_int), &pixels);
+#else
+	err |= clSetKernelArg(luminance_kernel, 3, sizeof(cl_int), &w);
+	err |= clSetKernelArg(luminance_kernel, 4, sizeof(cl_int), &h);
+#endif
+	/* Set arguments for complete kernel */
+	err |= clSetKernelArg(complete_kernel, 0, sizeof(cl_mem), &partial_buffer);
+	err |= clSetKernelArg(complete_kernel, 1, loc_size * sizeof(LumStats), NULL);
+	err |= clSetKernelArg(complete_kernel, 2, sizeof(cl_mem), &stats_buffer);
+	err |= clSetKernelArg(complete_kernel, 3, sizeof(cl_int), &count);
+
+	err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &bright_image);
+#if USE_BUFFERS
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_int), &w);
+#endif
 	if (err < 0) {
 		perror("Couldn't create a kernel argument");
-		getchar();
 		exit(1);
 	}
 
-	global_size[0] = width; global_size[1] = height;
-	err = clEnqueueNDRangeKernel(queue, transform_kernel, 2, NULL, global_size,
-		NULL, 0, NULL, NULL);
-
-	/* Read the result */
-	err = clEnqueueReadBuffer(queue, image_data, CL_TRUE, 0,
-		w * h * sizeof(float), data, 0, NULL, NULL);
+	/* Luminance histogram of the frame over the same work-groups, each
+	   merging its __local bins into histogram_buffer, which starts zeroed */
+	cl_uint* zero_bins = (cl_uint*)calloc(HISTOGRAM_BINS, sizeof(cl_uint));
+	histogram_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+		HISTOGRAM_BINS * sizeof(cl_uint), zero_bins, &err);
+	percentile_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+		sizeof(float), NULL, &err);
+	free(zero_bins);
 	if (err < 0) {
-		perror("Couldn't read the buffer");
-		getchar();
+		perror("Couldn't create a buffer");
 		exit(1);
-	}
-
-	data_buffer = clCreateBuffer(context, CL_MEM_READ_WRITE |
-		CL_MEM_USE_HOST_PTR, w * h * sizeof(float), data, &err);
-
-	/* Set arguments for vector kernel */
-	err = clSetKernelArg(vector_kernel, 0, sizeof(cl_mem), &data_buffer);
-	err |= clSetKernelArg(vector_kernel, 1, loc_size * 4 * sizeof(float), NULL);
-	/* Set arguments for complete kernel */
-	err = clSetKernelArg(complete_kernel, 0, sizeof(cl_mem), &data_buffer);
-	err |= clSetKernelArg(complete_kernel, 1, loc_size * 4 * sizeof(float), NULL);
-	err |= clSetKernelArg(complete_kernel, 2, sizeof(cl_mem), &sum_buffer);
-
-	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &input_image);
-	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &output_image);
-
+	};
 
-	/* Enqueue kernel */
-	glob_size = (w*h) / 4;
-	err = clEnqueueNDRangeKernel(queue, vector_kernel, 1, NULL, &glob_size,
-		&loc_size, 0, NULL, NULL);
+	err = clSetKernelArg(histogram_kernel, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(histogram_kernel, 1, sizeof(cl_mem), &histogram_buffer);
+#if USE_BUFFERS
+	err |= clSetKernelArg(histogram_kernel, 2, sizeof(cl_int), &pixels);
+#else
+	err |= clSetKernelArg(histogram_kernel, 2, sizeof(cl_int), &w);
+	err |= clSetKernelArg(histogram_kernel, 3, sizeof(cl_int), &h);
+#endif
 	if (err < 0) {
-		perror("Couldn't enqueue the kernel");
+		perror("Couldn't create a kernel argument");
 		exit(1);
 	}
 
-	/* Perform successive stages of the reduction */
-	while (glob_size / loc_size > loc_size) {
-		glob_size = glob_size / loc_size;
-		err = clEnqueueNDRangeKernel(queue, vector_kernel, 1, NULL, &glob_size,
+	/* Only the pass the default threshold comes from runs, the histogram
+	   with THRESHOLD_PERCENTILE set, the statistics for the mean otherwise */
+	if (THRESHOLD_PERCENTILE > 0) {
+		err = clEnqueueNDRangeKernel(queue, histogram_kernel, 1, NULL, &glob_size,
 			&loc_size, 0, NULL, NULL);
 		if (err < 0) {
 			perror("Couldn't enqueue the kernel");
 			exit(1);
 		}
 	}
-	glob_size = glob_size / loc_size;
-	err = clEnqueueNDRangeKernel(queue, complete_kernel, 1, NULL, &glob_size,
-		NULL, 0, NULL, NULL);
+	else {
+		err = clEnqueueNDRangeKernel(queue, luminance_kernel, 1, NULL, &glob_size,
+			&loc_size, 0, NULL, NULL);
+		err |= clEnqueueNDRangeKernel(queue, complete_kernel, 1, NULL, &loc_size,
+			&loc_size, 0, NULL, NULL);
+		if (err < 0) {
+			perror("Couldn't enqueue the kernel");
+			exit(1);
+		}
 
-	/* Read the result */
-	err = clEnqueueReadBuffer(queue, sum_buffer, CL_TRUE, 0,
-		sizeof(float), &sum, 0, NULL, NULL);
-	if (err < 0) {
-		perror("Couldn't read the buffer");
-		exit(1);
+		/* Read the result */
+		err = clEnqueueReadBuffer(queue, stats_buffer, CL_TRUE, 0,
+			sizeof(LumStats), &stats, 0, NULL, NULL);
+		if (err < 0) {
+			perror("Couldn't read the buffer");
+			exit(1);
+		}
+		printf("Average luminance %0.1f\n", stats.mean);
+		printf("Luminance range %0.1f to %0.1f, standard deviation %0.2f\n",
+			stats.min, stats.max, stats.count > 0 ? sqrt(stats.m2 / stats.count) : 0.0);
 	}
 
-
 	std::cout << "Threshold: ";
 	std::cin >> thres;
 	std::cin.ignore(100, '\n');
-	if (thres < 0)
-		thres = sum / (w*h);
-	err = clSetKernelArg(kernel, 2, sizeof(cl_mem), &thres);
+	if (thres < 0 && THRESHOLD_PERCENTILE > 0)
+		thres = query_percentile(queue, percentile_kernel, histogram_buffer,
+			percentile_buffer, loc_size, THRESHOLD_PERCENTILE);
+	else if (thres < 0)
+		thres = stats.mean;
+	err = clSetKernelArg(kernel, 2, sizeof(float), &thres);
 	if (err < 0) {
 		perror("Couldn't enqueue the kernel");
 		exit(1);
@@ -290,137 +1338,168 @@ int main(int argc, char **argv) {
 
 
 
-	//Enque pass kernel, read from pass kernel
+	/* Threshold, blur and composite run back to back on the in-order queue,
+	   only the final frame is read back */
 	global_size[0] = width; global_size[1] = height;
 	err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size,
 		NULL, 0, NULL, NULL);
-	origin[0] = 0; origin[1] = 0; origin[2] = 0;
-	region[0] = width; region[1] = height; region[2] = 1;
-	err = clEnqueueReadImage(queue, output_image, CL_TRUE, origin,
-		region, 0, 0, (void*)outputImage, 0, NULL, NULL);
-
-
-	//Reset input_image buffer to have the output from the pass kernel
-	input_image = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)outputImage, &err);
-	output_image = clCreateImage2D(context,
-		CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
-	//Pass it to the first pass blur kernel
-
-	err = clSetKernelArg(kernel4a, 0, sizeof(cl_mem), &input_image);
-	err |= clSetKernelArg(kernel4a, 1, sizeof(cl_mem), &output_image);
-	err |= clSetKernelArg(kernel4a, 2, sizeof(cl_int), &dimension);
-	if (err < 0) {
-		printf("Couldn't set a kernel argument");
-		exit(1);
-	};
-	//Enque first pass blur kernel 
-	global_size[0] = width; global_size[1] = height;
-	err = clEnqueueNDRangeKernel(queue, kernel4a, 2, NULL, global_size,
-		NULL, 0, NULL, NULL);
 	if (err < 0) {
 		perror("Couldn't enqueue the kernel");
 		exit(1);
 	}
-	//Read from first pass blur kernel
-	origin[0] = 0; origin[1] = 0; origin[2] = 0;
-	region[0] = width; region[1] = height; region[2] = 1;
-	err = clEnqueueReadImage(queue, output_image, CL_TRUE, origin,
-		region, 0, 0, (void*)outputImage, 0, NULL, NULL);
-	if (err < 0) {
-		perror("Couldn't read from the image object");
-		exit(1);
-	}
-
 
-	input_image = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)outputImage, &err);
-	output_image = clCreateImage2D(context,
-		CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
-	err = clSetKernelArg(kernel4b, 0, sizeof(cl_mem), &input_image);
-	err |= clSetKernelArg(kernel4b, 1, sizeof(cl_mem), &output_image);
+	err = clSetKernelArg(kernel4a, 0, sizeof(cl_mem), &bright_image);
+	err |= clSetKernelArg(kernel4a, 1, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(kernel4a, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(kernel4a, 3, sizeof(cl_mem), &filter_buffer);
+	err |= clSetKernelArg(kernel4b, 0, sizeof(cl_mem), &vertical_image);
+	err |= clSetKernelArg(kernel4b, 1, sizeof(cl_mem), &blurred_image);
 	err |= clSetKernelArg(kernel4b, 2, sizeof(cl_int), &dimension);
+	err |= clSetKernelArg(kernel4b, 3, sizeof(cl_mem), &filter_buffer);
+#if USE_BUFFERS
+	err |= clSetKernelArg(kernel4a, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(kernel4a, 5, sizeof(cl_int), &h);
+	err |= clSetKernelArg(kernel4b, 4, sizeof(cl_int), &w);
+	err |= clSetKernelArg(kernel4b, 5, sizeof(cl_int), &h);
+#else
+	err |= clSetKernelArg(kernel4a, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+	err |= clSetKernelArg(kernel4b, 4, sizeof(cl_float4) * (tile_size + dimension - 1) * tile_size, NULL);
+#endif
+	err |= clSetKernelArg(kernel5, 0, sizeof(cl_mem), &input_image);
+	err |= clSetKernelArg(kernel5, 1, sizeof(cl_mem), &blurred_image);
+	err |= clSetKernelArg(kernel5, 2, sizeof(cl_mem), &output_image);
+#if USE_BUFFERS
+	err |= clSetKernelArg(kernel5, 3, sizeof(cl_int), &w);
+#endif
 	if (err < 0) {
 		printf("Couldn't set a kernel argument");
 		exit(1);
 	};
-	
-	err = clEnqueueNDRangeKernel(queue, kernel4b, 2, NULL, global_size,
+
+	err = clEnqueueNDRangeKernel(queue, kernel4a, 2, NULL, tile_global,
+		tile_local, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(queue, kernel4b, 2, NULL, tile_global,
+		tile_local, 0, NULL, NULL);
+	err |= clEnqueueNDRangeKernel(queue, kernel5, 2, NULL, global_size,
 		NULL, 0, NULL, NULL);
 	if (err < 0) {
 		perror("Couldn't enqueue the kernel");
 		exit(1);
 	}
-	//Read in from the second pass blur kernel
-	origin[0] = 0; origin[1] = 0; origin[2] = 0;
-	region[0] = width; region[1] = height; region[2] = 1;
-	err = clEnqueueReadImage(queue, output_image, CL_TRUE, origin,
-		region, 0, 0, (void*)outputImage, 0, NULL, NULL);
+
+	err = read_frame(queue, output_image, width, height, outputImage);
 	if (err < 0) {
 		perror("Couldn't read from the image object");
 		exit(1);
 	}
 
+	/* Create output BMP file and write data */
+#if GREYSCALE
+	storeGreyscaleImage(outputImage, OUTPUT_FILE, h, w, GREY_INPUT_FILE);
+#else
+	storeRGBImage(outputImage, OUTPUT_FILE, h, w, INPUT_FILE);
+#endif
+	/* Create output BMP file and write data */
 
-
-
-
-	/****************************************/
-	input_image = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)inputImage, &err);
-	input_image2 = clCreateImage2D(context,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-		&img_format, width, height, 0, (void*)outputImage, &err);
-	output_image = clCreateImage2D(context,
-		CL_MEM_WRITE_ONLY, &img_format, width, height, 0, NULL, &err);
-	err = clSetKernelArg(kernel5, 0, sizeof(cl_mem), &input_image);
-	err |= clSetKernelArg(kernel5, 1, sizeof(cl_mem), &input_image2);
-	err |= clSetKernelArg(kernel5, 2, sizeof(cl_int), &output_image);
-	if (err < 0) {
-		printf("Couldn't set a kernel argument");
-		exit(1);
-	};
-
-	err = clEnqueueNDRangeKernel(queue, kernel5, 2, NULL, global_size,
-		NULL, 0, NULL, NULL);
-	if (err < 0) {
-		perror("Couldn't enqueue the kernel");
-		exit(1);
+#if BATCH_FRAMES > 0
+	/* Bloom copies of the input as one batch, in launches of as many frames as
+	   the array limit and the device memory allow */
+	size_t frame_bytes = width * height * CHANNELS;
+	size_t max_layers = batch_layers(device, frame_bytes);
+	if (max_layers == 0) {
+		printf("Not enough device memory to bloom frames as a batch\n");
 	}
-	//Read in from the second pass blur kernel
-	origin[0] = 0; origin[1] = 0; origin[2] = 0;
-	region[0] = width; region[1] = height; region[2] = 1;
-	err = clEnqueueReadImage(queue, output_image, CL_TRUE, origin,
-		region, 0, 0, (void*)outputImage, 0, NULL, NULL);
-	if (err < 0) {
-		perror("Couldn't read from the image object");
-		exit(1);
+	else {
+		unsigned char* batch_in = (unsigned char*)malloc(frame_bytes * BATCH_FRAMES);
+		unsigned char* batch_out = (unsigned char*)malloc(frame_bytes * BATCH_FRAMES);
+		double batch_time = 0;
+
+		for (int i = 0; i < BATCH_FRAMES; i++)
+			memcpy(batch_in + i * frame_bytes, inputImage, frame_bytes);
+		for (size_t first = 0; first < BATCH_FRAMES; first += max_layers) {
+			size_t layers = BATCH_FRAMES - first < max_layers ? BATCH_FRAMES - first : max_layers;
+			batch_time += bloom_batch(context, queue, program, &img_format, width, height,
+				batch_in + first * frame_bytes, batch_out + first * frame_bytes, layers,
+				dimension, filter_buffer, thres);
+		}
+		printf("Bloomed a batch of %d frames in %0.3f milliseconds\n", BATCH_FRAMES, batch_time / 1000000.0);
+		printf("Last frame differs from the single frame bloom by at most %d\n",
+			max_difference(outputImage, batch_out + (BATCH_FRAMES - 1) * frame_bytes, width * height, CHANNELS));
+		free(batch_in);
+		free(batch_out);
 	}
-	/************************************************/
+#endif
 
+#if RUN_FISSION
+	/* Many small jobs at once on sub-devices of a CPU against one after another on the whole CPU */
+	cl_device_type device_type;
+	cl_device_id subs[MAX_SUB_DEVICES];
+	cl_uint sub_count = 0;
+	clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(device_type), &device_type, NULL);
+	if (device_type & CL_DEVICE_TYPE_CPU)
+		sub_count = create_sub_devices(device, FISSION_UNITS, FISSION_JOBS, subs, MAX_SUB_DEVICES);
+	if (!(device_type & CL_DEVICE_TYPE_CPU))
+		printf("Device fission is only tried on CPU devices\n");
+	else if (sub_count == 0)
+		printf("The device could not be partitioned into sub-devices\n");
+	else {
+		BloomDevice whole, sub_blooms[MAX_SUB_DEVICES];
+		unsigned char* job_out = (unsigned char*)malloc(width * height * CHANNELS * sub_count);
+		double whole_time, fission_time;
+		int job_diff = 0;
 
+		create_bloom_device(&whole, device, options, &img_format, width, height, tile_size,
+			weights, radius, thres);
+		for (cl_uint i = 0; i < sub_count; i++)
+			create_bloom_device(&sub_blooms[i], subs[i], options, &img_format, width, height, tile_size,
+				weights, radius, thres);
+		/* One untimed job each so first launch costs stay out of the timing */
+		bloom_jobs(&whole, 1, inputImage, job_out, 1);
+		bloom_jobs(sub_blooms, sub_count, inputImage, job_out, sub_count);
 
-	/* Create output BMP file and write data */
-	storeRGBImage(outputImage, OUTPUT_FILE, h, w, INPUT_FILE);
-	/* Create output BMP file and write data */
+		whole_time = bloom_jobs(&whole, 1, inputImage, job_out, FISSION_JOBS);
+		fission_time = bloom_jobs(sub_blooms, sub_count, inputImage, job_out, FISSION_JOBS);
+		printf("%d jobs on %d sub-devices:\n", FISSION_JOBS, (int)sub_count);
+		printf("\tWhole device, one job at a time: %0.3f milliseconds\n", whole_time / 1000000.0);
+		printf("\tSub-devices, %d jobs at a time: %0.3f milliseconds\n", (int)sub_count, fission_time / 1000000.0);
+		for (cl_uint i = 0; i < sub_count; i++) {
+			int diff = max_difference(outputImage, job_out + i * width * height * CHANNELS,
+				width * height, CHANNELS);
+			if (diff > job_diff)
+				job_diff = diff;
+		}
+		printf("\tSub-device jobs differ from the single frame bloom by at most %d\n", job_diff);
+
+		release_bloom_device(&whole);
+		for (cl_uint i = 0; i < sub_count; i++) {
+			release_bloom_device(&sub_blooms[i]);
+			clReleaseDevice(subs[i]);
+		}
+		free(job_out);
+	}
+#endif
 
 	getchar();
 
 	/* Deallocate resources */
 	free(inputImage);
 	free(outputImage);
-	clReleaseMemObject(sum_buffer);
-	clReleaseMemObject(data_buffer);
-	clReleaseMemObject(image_data);
+	free(weights);
+	clReleaseMemObject(stats_buffer);
+	clReleaseMemObject(filter_buffer);
+	clReleaseMemObject(partial_buffer);
+	clReleaseMemObject(histogram_buffer);
+	clReleaseMemObject(percentile_buffer);
 	clReleaseMemObject(input_image);
 	clReleaseMemObject(output_image);
-	clReleaseKernel(vector_kernel);
+	clReleaseMemObject(bright_image);
+	clReleaseMemObject(vertical_image);
+	clReleaseMemObject(blurred_image);
 	clReleaseKernel(complete_kernel);
 	clReleaseKernel(kernel);
-	clReleaseKernel(transform_kernel);
+	clReleaseKernel(luminance_kernel);
+	clReleaseKernel(histogram_kernel);
+	clReleaseKernel(percentile_kernel);
 	clReleaseKernel(kernel4a);
 	clReleaseKernel(kernel4b);
 	clReleaseKernel(kernel5);
@@ -37,7 +37,7 @@ unsigned char* readGreyscaleImage(const char *filename, int* widthOut, int* heig
    *widthOut = width;
    *heightOut = height;    
 
-   imageData = (unsigned char*)malloc(width*height);
+   imageData = (unsigned char*)malloc((size_t)width*height);
    if(imageData == NULL) {
        perror("malloc");
        exit(-1);
@@ -57,7 +57,7 @@ unsigned char* readGreyscaleImage(const char *filename, int* widthOut, int* heig
    // we want the image to be right-side up, so we'll modify it here.
 
    for(i = height-1; i >= 0; i--) {
-      fread(&imageData[i*width], sizeof(char), width, fp);
+      fread(&imageData[(size_t)i*width], sizeof(char), width, fp);
 
 	  // For the bmp format, each row has to be a multiple of 4, 
       // so I need to read in the junk data and throw it away
@@ -131,7 +131,7 @@ void storeGreyscaleImage(unsigned char* imageOut, const char *filename, int rows
       mod = 4 - mod;
    }
    for(i = height-1; i >= 0; i--) {
-      fwrite(&imageOut[i*cols], sizeof(char), width, ofp);
+      fwrite(&imageOut[(size_t)i*cols], sizeof(char), width, ofp);
 
 	  // In bmp format, rows must be a multiple of 4-bytes.  
       // So if we're not at a multiple of 4, add junk padding.
@@ -183,7 +183,7 @@ unsigned char* readRGBImage(const char *filename, int* widthOut, int* heightOut)
    *widthOut = width;
    *heightOut = height;    
 
-   imageData = (unsigned char*)malloc(width*height*4);
+   imageData = (unsigned char*)malloc((size_t)width*height*4);
    if(imageData == NULL) {
        perror("malloc");
        exit(-1);
@@ -207,10 +207,10 @@ unsigned char* readRGBImage(const char *filename, int* widthOut, int* heightOut)
    for(i = height-1; i >= 0; i--) {
       for(j = 0; j < rowsize; j+=4) {
          fread(tmp, sizeof(char), 3, fp);
-         imageData[i*rowsize + j] = tmp[0];
-         imageData[i*rowsize + j+1] = tmp[1];
-         imageData[i*rowsize + j+2] = tmp[2];
-         imageData[i*rowsize + j+3] = 255;
+         imageData[(size_t)i*rowsize + j] = tmp[0];
+         imageData[(size_t)i*rowsize + j+1] = tmp[1];
+         imageData[(size_t)i*rowsize + j+2] = tmp[2];
+         imageData[(size_t)i*rowsize + j+3] = 255;
       }
       // For the bmp format, each row has to be a multiple of 4, 
       // so I need to read in the junk data and throw it away
@@ -285,9 +285,9 @@ void storeRGBImage(unsigned char* imageOut, const char *filename, int rows, int
 
    for(i = height-1; i >= 0; i--) {
       for(j = 0; j < width*4; j+=4) {
-         tmp[0] = (unsigned char)imageOut[i*cols*4+j];
-         tmp[1] = (unsigned char)imageOut[i*cols*4+j+1];
-         tmp[2] = (unsigned char)imageOut[i*cols*4+j+2];
+         tmp[0] = (unsigned char)imageOut[(size_t)i*cols*4+j];
+         tmp[1] = (unsigned char)imageOut[(size_t)i*cols*4+j+1];
+         tmp[2] = (unsigned char)imageOut[(size_t)i*cols*4+j+2];
          fwrite(tmp, sizeof(char), 3, ofp);
       }
 